@@ -37,6 +37,7 @@ ifeq ($(TARGET_USES_HWC2), false)
 LOCAL_SRC_FILES := \
         common/RemoteDisplay.cpp \
         common/RemoteDisplayMgr.cpp \
+        common/ShmRing.cpp \
         hwc1/Hwc1Device.cpp \
         hwc1/Hwc1Display.cpp \
 
@@ -67,13 +68,23 @@ LOCAL_CPPFLAGS += \
         -DSUPPORT_HWC_2_2 \
         -DSUPPORT_HWC_2_3 \
         -DSUPPORT_HWC_2_4
+ENABLE_GRALLOC4 := true
 endif
 
 LOCAL_SRC_FILES := \
         common/RemoteDisplay.cpp \
         common/RemoteDisplayMgr.cpp \
+        common/ShmRing.cpp \
         common/LocalDisplay.cpp \
         common/BufferMapper.cpp \
+        common/Gralloc1Mapper.cpp \
+        common/MemfdMapper.cpp \
+        common/VsyncThread.cpp \
+        common/IdleTimer.cpp \
+        common/SyncTimeline.cpp \
+        common/PixelKernels.cpp \
+        hwc2/Hwc2Compositor.cpp \
+        hwc2/Hwc2Planner.cpp \
         hwc2/Hwc2Device.cpp \
         hwc2/Hwc2Display.cpp \
         hwc2/Hwc2Layer.cpp \
@@ -93,7 +104,8 @@ endif
 
 ifeq ($(ENABLE_HWC_UIO), true)
 LOCAL_SRC_FILES += \
-        uio/UioDisplay.cpp
+        uio/UioDisplay.cpp \
+        uio/UioWatcher.cpp
 
 LOCAL_CPPFLAGS += \
         -DENABLE_HWC_UIO
@@ -115,6 +127,24 @@ LOCAL_SHARED_LIBRARIES := \
         liblog \
         libcutils \
         libhardware \
+        libsync \
+
+ifeq ($(ENABLE_GRALLOC4), true)
+LOCAL_SRC_FILES += \
+        common/Gralloc4Mapper.cpp
+
+# the mapper 4.0 and gralloctypes headers need C++17
+LOCAL_CPPFLAGS += \
+        -DENABLE_GRALLOC4 \
+        -std=c++17
+
+LOCAL_SHARED_LIBRARIES += \
+        libgralloctypes \
+        libhidlbase \
+        libutils \
+        android.hardware.graphics.allocator@4.0 \
+        android.hardware.graphics.mapper@4.0
+endif
 
 LOCAL_PROPRIETARY_MODULE := true
 LOCAL_MODULE := hwcomposer.remote
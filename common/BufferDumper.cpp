@@ -30,8 +30,11 @@ Date: 2021.06.09
 #include <errno.h>
 #include <sys/stat.h>
 
+#include <vector>
+
 #include "BufferDumper.h"
 #include "BufferMapper.h"
+#include "PixelKernels.h"
 #include <unistd.h>
 
 BufferDumper::BufferDumper() {
@@ -85,27 +88,47 @@ int BufferDumper::dumpBuffer(buffer_handle_t b, uint32_t frameNum) {
     return 0;
 
   uint8_t* rgb = nullptr;
-  uint32_t stride = 0;
-  uint32_t w = 0, h = 0;
+  BufferMapper::BufferInfo info = {};
 
+  // only gralloc1 maps buffers it didn't import
   auto& mapper = BufferMapper::getMapper();
-  mapper.getBufferSize(b, w, h);
-  mapper.lockBuffer(b, rgb, stride);
+  buffer_handle_t imported = nullptr;
+  if (mapper.importBuffer(b, &imported) < 0) {
+    ALOGE("Failed to import buffer %p for dump", b);
+    return -1;
+  }
+  if (mapper.describe(imported, info) == 0) {
+    mapper.lockBuffer(imported, info.width, info.height, rgb);
+  }
+  uint32_t w = info.width, h = info.height, stride = info.stride;
   if (rgb && w && h) {
+    // png wants RGBA, the buffer may be BGRA or have no alpha
+    std::vector<uint8_t> pixels(w * h * 4);
+    if (info.format == HAL_PIXEL_FORMAT_BGRA_8888) {
+      PixelKernels::swizzle(pixels.data(), w * 4, rgb, stride * 4, w, h);
+    } else if (info.format == HAL_PIXEL_FORMAT_RGBX_8888) {
+      PixelKernels::fillAlpha(pixels.data(), w * 4, rgb, stride * 4, w, h);
+    } else {
+      PixelKernels::copy(pixels.data(), w * 4, rgb, stride * 4, w, h);
+    }
+
     char path[128];
     snprintf(path, 128, "%s/fb-%d.png", kDumpFolder, frameNum);
     ImageData image;
     image.width = w;
     image.height = h;
-    image.stride = stride * 4;
+    image.stride = w * 4;
     image.bpc = 8;
     image.alpha = true;
-    image.data = rgb;
+    image.data = pixels.data();
     dumpToPng(path, &image);
   } else {
     ALOGE("Failed to lock front buffer\n");
   }
-  mapper.unlockBuffer(b);
+  if (rgb) {
+    mapper.unlockBuffer(imported);
+  }
+  mapper.release(imported);
   return 0;
 }
 
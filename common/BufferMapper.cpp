@@ -25,168 +25,194 @@ Date: 2021.06.09
 
 //#define LOG_NDEBUG 0
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "BufferMapper.h"
+#include "Gralloc1Mapper.h"
+#include "MemfdMapper.h"
+#ifdef ENABLE_GRALLOC4
+#include "Gralloc4Mapper.h"
+#endif
 
 BufferMapper::BufferMapper() {
   ALOGV("%s", __func__);
-  getGrallocDevice();
+  openBackend();
 }
 
 BufferMapper::~BufferMapper() {
   ALOGV("%s", __func__);
-  if (mGralloc) {
-    gralloc1_close(mGralloc);
-  }
 }
 
-int BufferMapper::getGrallocDevice() {
+int BufferMapper::openBackend() {
   ALOGV("%s", __func__);
 
-  const hw_module_t* mod = nullptr;
-
-  if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &mod) != 0) {
-    ALOGE("Failed to load gralloc module");
-    return -1;
+  char value[PROPERTY_VALUE_MAX];
+  if (property_get("hwc_vhal.mapper", value, nullptr) <= 0) {
+    value[0] = '\0';
   }
 
-  if (gralloc1_open(mod, &mGralloc) != 0) {
-    ALOGE("Failed to open gralloc1 device");
-    return -1;
+  std::vector<std::unique_ptr<IGrallocMapper>> candidates;
+  if (!strcmp(value, "memfd")) {
+    candidates.emplace_back(new MemfdMapper());
+  }
+#ifdef ENABLE_GRALLOC4
+  if (!value[0] || !strcmp(value, "gralloc4")) {
+    candidates.emplace_back(new Gralloc4Mapper());
+  }
+#endif
+  if (!value[0] || !strcmp(value, "gralloc1")) {
+    candidates.emplace_back(new Gralloc1Mapper());
   }
 
-  if (mGralloc) {
-    pfnLock = (GRALLOC1_PFN_LOCK)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_LOCK));
-    pfnUnlock = (GRALLOC1_PFN_UNLOCK)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_UNLOCK));
-    pfnGetDimensions = (GRALLOC1_PFN_GET_DIMENSIONS)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_GET_DIMENSIONS));
-    pfnGetFormat = (GRALLOC1_PFN_GET_FORMAT)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_GET_FORMAT));
-    pfnGetStride = (GRALLOC1_PFN_GET_STRIDE)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_GET_STRIDE));
-    pfnImportBuffer = (GRALLOC1_PFN_IMPORT_BUFFER)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_IMPORT_BUFFER));
-    pfnRelease = (GRALLOC1_PFN_RELEASE)(
-        mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_RELEASE));
+  for (auto& c : candidates) {
+    if (c->init() == 0) {
+      mBackend = std::move(c);
+      ALOGI("Buffer mapper backend: %s", mBackend->name());
+      return 0;
+    }
   }
-  return 0;
+  ALOGE("No buffer mapper backend%s%s, buffers can't be accessed",
+        value[0] ? " for " : "", value);
+  return -1;
 }
 
-int BufferMapper::getBufferSize(buffer_handle_t b, uint32_t& w, uint32_t& h) {
+int BufferMapper::describe(buffer_handle_t b, BufferInfo& info) {
   ALOGV("%s", __func__);
 
-  if (!b || !pfnGetDimensions) {
+  if (!b || !mBackend) {
     return -1;
   }
 
-  if (pfnGetDimensions(mGralloc, b, &w, &h) != 0) {
-    ALOGE("Failed to getDimensions for buffer %p", b);
-    return -1;
+  CacheKey key(b, b->numFds > 0 ? b->data[0] : -1);
+  std::lock_guard<std::mutex> lock(mCacheMutex);
+  for (size_t i = 0; i < mCache.size(); i++) {
+    if (mCache[i].first == key) {
+      auto entry = mCache[i];
+      mCache.erase(mCache.begin() + i);
+      mCache.insert(mCache.begin(), entry);
+      info = entry.second;
+      return 0;
+    }
   }
 
+  if (mBackend->describe(b, info) < 0) {
+    return -1;
+  }
+  if (mCache.size() >= kMaxCachedBuffers) {
+    mCache.pop_back();
+  }
+  mCache.insert(mCache.begin(), std::make_pair(key, info));
   return 0;
 }
 
-int BufferMapper::getBufferFormat(buffer_handle_t b, int32_t& f) {
+int BufferMapper::getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes) {
   ALOGV("%s", __func__);
 
-  if (!b || !pfnGetFormat) {
+  if (!b || !mBackend) {
     return -1;
   }
+  return mBackend->getPlanes(b, planes);
+}
 
-  if (pfnGetFormat(mGralloc, b, &f) != 0) {
-    ALOGE("Failed to pfnGetFormat for buffer %p", b);
+int BufferMapper::getBufferSize(buffer_handle_t b, uint32_t& w, uint32_t& h) {
+  BufferInfo info;
+  if (describe(b, info) < 0) {
     return -1;
   }
-
+  w = info.width;
+  h = info.height;
   return 0;
 }
 
-int BufferMapper::getBufferStride(buffer_handle_t b, uint32_t& s) {
-  ALOGV("%s", __func__);
-
-  if (!b || !pfnGetStride) {
+int BufferMapper::getBufferFormat(buffer_handle_t b, int32_t& f) {
+  BufferInfo info;
+  if (describe(b, info) < 0) {
     return -1;
   }
+  f = info.format;
+  return 0;
+}
 
-  if (pfnGetStride(mGralloc, b, &s) != 0) {
-    ALOGE("Failed to get buffer %p stride", b);
+int BufferMapper::getBufferStride(buffer_handle_t b, uint32_t& s) {
+  BufferInfo info;
+  if (describe(b, info) < 0) {
     return -1;
   }
-
+  s = info.stride;
   return 0;
 }
 
 int BufferMapper::lockBuffer(buffer_handle_t b, uint8_t*& data, uint32_t& s) {
   ALOGV("%s", __func__);
 
-  if (!b || !pfnLock) {
+  BufferInfo info;
+  if (describe(b, info) < 0) {
+    ALOGE("Failed to describe buffer %p", b);
     return -1;
   }
+  s = info.stride;
+  return lockBuffer(b, info.width, info.height, data);
+}
 
-  uint32_t w, h;
-  if (getBufferSize(b, w, h) < 0) {
-    ALOGE("Failed to get buffer size for buffer %p", b);
-    return -1;
-  }
-  if (getBufferStride(b, s) < 0) {
-    ALOGE("Failed to get buffer %p stride", b);
-    return -1;
-  }
+int BufferMapper::lockBuffer(buffer_handle_t b,
+                             uint32_t w,
+                             uint32_t h,
+                             uint8_t*& data) {
+  ALOGV("%s", __func__);
 
-  gralloc1_rect_t rect = {0, 0, (int32_t)w, (int32_t)h};
-  int fenceFd = -1;
-  if (pfnLock(mGralloc, b, 0x0, 0x3, &rect, (void**)&data, fenceFd) != 0) {
-    ALOGE("Failed to lock buffer %p", b);
+  if (!b || !mBackend) {
     return -1;
   }
-  // ALOGD("lock buffer with w=%d h= %d return addr %p stride=%d", w, h, *data,
-  // *s);
-  return 0;
+  return mBackend->lock(b, w, h, data);
 }
 
 int BufferMapper::unlockBuffer(buffer_handle_t b) {
   ALOGV("%s", __func__);
 
-  if (!b || !pfnUnlock) {
+  if (!b || !mBackend) {
     return -1;
   }
+  return mBackend->unlock(b);
+}
 
-  int releaseFenceFd = -1;
+int BufferMapper::importBuffer(buffer_handle_t b, buffer_handle_t *bufferHandle) {
+  ALOGV("%s", __func__);
 
-  if (pfnUnlock(mGralloc, b, &releaseFenceFd) != 0) {
-    ALOGE("Failed to unlock buffer %p", b);
+  if (!b || !mBackend) {
     return -1;
   }
-  if (releaseFenceFd >= 0) {
-    close(releaseFenceFd);
-  }
-  return 0;
+  return mBackend->importBuffer(b, bufferHandle);
 }
 
-int BufferMapper::importBuffer(buffer_handle_t b, buffer_handle_t *bufferHandle) {
+int BufferMapper::release(buffer_handle_t b) {
   ALOGV("%s", __func__);
 
-  if (!b || !pfnImportBuffer) {
+  if (!b || !mBackend) {
     return -1;
   }
-  if (pfnImportBuffer(mGralloc, b, bufferHandle) != 0) {
-    return -1;
+
+  std::unique_lock<std::mutex> lock(mCacheMutex);
+  for (auto it = mCache.begin(); it != mCache.end(); ++it) {
+    if (it->first.first == b) {
+      mCache.erase(it);
+      break;
+    }
   }
-  return 0;
+  lock.unlock();
+
+  return mBackend->release(b);
 }
 
-int BufferMapper::release(buffer_handle_t b) {
+int BufferMapper::allocate(uint32_t width,
+                           uint32_t height,
+                           int32_t format,
+                           buffer_handle_t* out) {
   ALOGV("%s", __func__);
 
-  if (!b || !pfnRelease) {
+  if (!mBackend) {
     return -1;
   }
-  if (pfnRelease(mGralloc, b) != 0) {
-    return -1;
-  }
-  return 0;
+  return mBackend->allocate(width, height, format, out);
 }
@@ -26,10 +26,19 @@ Date: 2021.06.09
 #ifndef __BUFFER_MAPPER_H__
 #define __BUFFER_MAPPER_H__
 
-#include <hardware/gralloc1.h>
 #include <hardware/hwcomposer2.h>
 #include <system/graphics.h>
 
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "IGrallocMapper.h"
+
+// Buffer access through the mapper backend of the image: IMapper 4.0 when
+// built with it and its service runs, else gralloc1. The property
+// hwc_vhal.mapper (gralloc1, gralloc4, memfd) forces one.
 class BufferMapper {
  public:
   ~BufferMapper();
@@ -39,26 +48,44 @@ class BufferMapper {
     return sInst;
   }
 
+  // null if no backend could be opened
+  IGrallocMapper* backend() { return mBackend.get(); }
+
+  // What gralloc reports about a buffer, it doesn't change for its lifetime
+  // so it is cached for the last kMaxCachedBuffers buffers queried. The
+  // entry of a buffer is dropped when it is released.
+  typedef IGrallocMapper::BufferInfo BufferInfo;
+  int describe(buffer_handle_t b, BufferInfo& info);
+  typedef IGrallocMapper::PlaneInfo PlaneInfo;
+  int getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes);
+
   int getBufferSize(buffer_handle_t b, uint32_t& w, uint32_t& h);
   int getBufferFormat(buffer_handle_t b, int32_t& f);
   int getBufferStride(buffer_handle_t b, uint32_t& s);
   int lockBuffer(buffer_handle_t b, uint8_t*& data, uint32_t& s);
+  // for callers that already know the buffer size
+  int lockBuffer(buffer_handle_t b, uint32_t w, uint32_t h, uint8_t*& data);
   int unlockBuffer(buffer_handle_t b);
   int importBuffer(buffer_handle_t b, buffer_handle_t *bufferHandle);
   int release(buffer_handle_t b);
+  // freed with release
+  int allocate(uint32_t width,
+               uint32_t height,
+               int32_t format,
+               buffer_handle_t* out);
 
  private:
   BufferMapper();
-  int getGrallocDevice();
+  int openBackend();
 
  private:
-  gralloc1_device_t* mGralloc = nullptr;
-  GRALLOC1_PFN_LOCK pfnLock = nullptr;
-  GRALLOC1_PFN_UNLOCK pfnUnlock = nullptr;
-  GRALLOC1_PFN_GET_DIMENSIONS pfnGetDimensions = nullptr;
-  GRALLOC1_PFN_GET_FORMAT pfnGetFormat = nullptr;
-  GRALLOC1_PFN_GET_STRIDE pfnGetStride = nullptr;
-  GRALLOC1_PFN_IMPORT_BUFFER pfnImportBuffer = nullptr;
-  GRALLOC1_PFN_RELEASE pfnRelease = nullptr;
+  std::unique_ptr<IGrallocMapper> mBackend;
+
+  // the fd guards against a handle address reused for another buffer
+  typedef std::pair<buffer_handle_t, int> CacheKey;
+  const size_t kMaxCachedBuffers = 32;
+  std::mutex mCacheMutex;
+  // most recently used first
+  std::vector<std::pair<CacheKey, BufferInfo>> mCache;
 };
 #endif
@@ -0,0 +1,194 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+#include <unistd.h>
+
+#include "Gralloc1Mapper.h"
+
+Gralloc1Mapper::~Gralloc1Mapper() {
+  ALOGV("%s", __func__);
+  if (mGralloc) {
+    gralloc1_close(mGralloc);
+  }
+}
+
+int Gralloc1Mapper::init() {
+  ALOGV("%s", __func__);
+
+  const hw_module_t* mod = nullptr;
+
+  if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &mod) != 0) {
+    ALOGE("Failed to load gralloc module");
+    return -1;
+  }
+
+  if (gralloc1_open(mod, &mGralloc) != 0 || !mGralloc) {
+    ALOGE("Failed to open gralloc1 device");
+    mGralloc = nullptr;
+    return -1;
+  }
+
+  pfnLock = (GRALLOC1_PFN_LOCK)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_LOCK));
+  pfnUnlock = (GRALLOC1_PFN_UNLOCK)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_UNLOCK));
+  pfnGetDimensions = (GRALLOC1_PFN_GET_DIMENSIONS)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_GET_DIMENSIONS));
+  pfnGetFormat = (GRALLOC1_PFN_GET_FORMAT)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_GET_FORMAT));
+  pfnGetStride = (GRALLOC1_PFN_GET_STRIDE)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_GET_STRIDE));
+  pfnImportBuffer = (GRALLOC1_PFN_IMPORT_BUFFER)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_IMPORT_BUFFER));
+  pfnRelease = (GRALLOC1_PFN_RELEASE)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_RELEASE));
+  pfnCreateDescriptor = (GRALLOC1_PFN_CREATE_DESCRIPTOR)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_CREATE_DESCRIPTOR));
+  pfnDestroyDescriptor = (GRALLOC1_PFN_DESTROY_DESCRIPTOR)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_DESTROY_DESCRIPTOR));
+  pfnSetDimensions = (GRALLOC1_PFN_SET_DIMENSIONS)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_SET_DIMENSIONS));
+  pfnSetFormat = (GRALLOC1_PFN_SET_FORMAT)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_SET_FORMAT));
+  pfnSetProducerUsage = (GRALLOC1_PFN_SET_PRODUCER_USAGE)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_SET_PRODUCER_USAGE));
+  pfnSetConsumerUsage = (GRALLOC1_PFN_SET_CONSUMER_USAGE)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_SET_CONSUMER_USAGE));
+  pfnAllocate = (GRALLOC1_PFN_ALLOCATE)(
+      mGralloc->getFunction(mGralloc, GRALLOC1_FUNCTION_ALLOCATE));
+  if (!pfnLock || !pfnUnlock) {
+    ALOGE("gralloc1 device can't lock buffers");
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc1Mapper::describe(buffer_handle_t b, BufferInfo& info) {
+  if (!pfnGetDimensions || !pfnGetFormat || !pfnGetStride) {
+    return -1;
+  }
+
+  if (pfnGetDimensions(mGralloc, b, &info.width, &info.height) != 0) {
+    ALOGE("Failed to getDimensions for buffer %p", b);
+    return -1;
+  }
+  if (pfnGetFormat(mGralloc, b, &info.format) != 0) {
+    ALOGE("Failed to pfnGetFormat for buffer %p", b);
+    return -1;
+  }
+  if (pfnGetStride(mGralloc, b, &info.stride) != 0) {
+    ALOGE("Failed to get buffer %p stride", b);
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc1Mapper::getPlanes(buffer_handle_t b,
+                              std::vector<PlaneInfo>& planes) {
+  BufferInfo info;
+  if (describe(b, info) < 0) {
+    return -1;
+  }
+  uint32_t bpp = bytesPerPixel(info.format);
+  if (!bpp) {
+    ALOGE("No plane layout for format %d with gralloc1", info.format);
+    return -1;
+  }
+  planes.assign(1, {0, info.stride * bpp, info.width, info.height});
+  return 0;
+}
+
+int Gralloc1Mapper::lock(buffer_handle_t b,
+                         uint32_t w,
+                         uint32_t h,
+                         uint8_t*& data) {
+  gralloc1_rect_t rect = {0, 0, (int32_t)w, (int32_t)h};
+  int fenceFd = -1;
+  if (pfnLock(mGralloc, b, 0x0, 0x3, &rect, (void**)&data, fenceFd) != 0) {
+    ALOGE("Failed to lock buffer %p", b);
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc1Mapper::unlock(buffer_handle_t b) {
+  int releaseFenceFd = -1;
+
+  if (pfnUnlock(mGralloc, b, &releaseFenceFd) != 0) {
+    ALOGE("Failed to unlock buffer %p", b);
+    return -1;
+  }
+  if (releaseFenceFd >= 0) {
+    close(releaseFenceFd);
+  }
+  return 0;
+}
+
+int Gralloc1Mapper::importBuffer(buffer_handle_t b, buffer_handle_t* out) {
+  if (!pfnImportBuffer || pfnImportBuffer(mGralloc, b, out) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc1Mapper::release(buffer_handle_t b) {
+  if (!pfnRelease || pfnRelease(mGralloc, b) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc1Mapper::allocate(uint32_t width,
+                             uint32_t height,
+                             int32_t format,
+                             buffer_handle_t* out) {
+  if (!pfnCreateDescriptor || !pfnDestroyDescriptor || !pfnSetDimensions ||
+      !pfnSetFormat || !pfnSetProducerUsage || !pfnSetConsumerUsage ||
+      !pfnAllocate) {
+    ALOGE("gralloc1 device can't allocate buffers");
+    return -1;
+  }
+
+  gralloc1_buffer_descriptor_t desc;
+  if (pfnCreateDescriptor(mGralloc, &desc) != GRALLOC1_ERROR_NONE) {
+    ALOGE("Failed to create a buffer descriptor");
+    return -1;
+  }
+  int ret = -1;
+  if (pfnSetDimensions(mGralloc, desc, width, height) ==
+          GRALLOC1_ERROR_NONE &&
+      pfnSetFormat(mGralloc, desc, format) == GRALLOC1_ERROR_NONE &&
+      pfnSetProducerUsage(mGralloc, desc,
+                          GRALLOC1_PRODUCER_USAGE_CPU_WRITE_OFTEN) ==
+          GRALLOC1_ERROR_NONE &&
+      pfnSetConsumerUsage(mGralloc, desc,
+                          GRALLOC1_CONSUMER_USAGE_CPU_READ_OFTEN) ==
+          GRALLOC1_ERROR_NONE &&
+      pfnAllocate(mGralloc, 1, &desc, out) == GRALLOC1_ERROR_NONE) {
+    ret = 0;
+  } else {
+    ALOGE("Failed to allocate a %ux%u buffer of format %d", width, height,
+          format);
+  }
+  pfnDestroyDescriptor(mGralloc, desc);
+  return ret;
+}
@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __GRALLOC1_MAPPER_H__
+#define __GRALLOC1_MAPPER_H__
+
+#include <hardware/gralloc1.h>
+
+#include "IGrallocMapper.h"
+
+class Gralloc1Mapper : public IGrallocMapper {
+ public:
+  Gralloc1Mapper() {}
+  ~Gralloc1Mapper();
+
+  const char* name() const override { return "gralloc1"; }
+  int init() override;
+  int describe(buffer_handle_t b, BufferInfo& info) override;
+  // single plane formats only, gralloc1 has no plane layouts without flex
+  // locking
+  int getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes) override;
+  int lock(buffer_handle_t b, uint32_t w, uint32_t h, uint8_t*& data) override;
+  int unlock(buffer_handle_t b) override;
+  int importBuffer(buffer_handle_t b, buffer_handle_t* out) override;
+  int release(buffer_handle_t b) override;
+  int allocate(uint32_t width,
+               uint32_t height,
+               int32_t format,
+               buffer_handle_t* out) override;
+
+ private:
+  gralloc1_device_t* mGralloc = nullptr;
+  GRALLOC1_PFN_LOCK pfnLock = nullptr;
+  GRALLOC1_PFN_UNLOCK pfnUnlock = nullptr;
+  GRALLOC1_PFN_GET_DIMENSIONS pfnGetDimensions = nullptr;
+  GRALLOC1_PFN_GET_FORMAT pfnGetFormat = nullptr;
+  GRALLOC1_PFN_GET_STRIDE pfnGetStride = nullptr;
+  GRALLOC1_PFN_IMPORT_BUFFER pfnImportBuffer = nullptr;
+  GRALLOC1_PFN_RELEASE pfnRelease = nullptr;
+  GRALLOC1_PFN_CREATE_DESCRIPTOR pfnCreateDescriptor = nullptr;
+  GRALLOC1_PFN_DESTROY_DESCRIPTOR pfnDestroyDescriptor = nullptr;
+  GRALLOC1_PFN_SET_DIMENSIONS pfnSetDimensions = nullptr;
+  GRALLOC1_PFN_SET_FORMAT pfnSetFormat = nullptr;
+  GRALLOC1_PFN_SET_PRODUCER_USAGE pfnSetProducerUsage = nullptr;
+  GRALLOC1_PFN_SET_CONSUMER_USAGE pfnSetConsumerUsage = nullptr;
+  GRALLOC1_PFN_ALLOCATE pfnAllocate = nullptr;
+};
+
+#endif  // __GRALLOC1_MAPPER_H__
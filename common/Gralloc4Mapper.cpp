@@ -0,0 +1,227 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+
+#include <gralloctypes/Gralloc4.h>
+
+#include "Gralloc4Mapper.h"
+
+using aidl::android::hardware::graphics::common::PlaneLayout;
+using android::hardware::hidl_handle;
+using android::hardware::hidl_vec;
+using android::hardware::graphics::common::V1_2::BufferUsage;
+using android::hardware::graphics::common::V1_2::PixelFormat;
+using android::hardware::graphics::mapper::V4_0::BufferDescriptor;
+using android::hardware::graphics::mapper::V4_0::Error;
+
+int Gralloc4Mapper::init() {
+  ALOGV("%s", __func__);
+
+  mMapper = IMapper::getService();
+  if (!mMapper) {
+    ALOGE("No IMapper 4.0 service");
+    return -1;
+  }
+  mAllocator = IAllocator::getService();
+  if (!mAllocator) {
+    ALOGW("No IAllocator 4.0 service, buffers can't be allocated");
+  }
+  return 0;
+}
+
+int Gralloc4Mapper::getMetadata(buffer_handle_t b,
+                                const IMapper::MetadataType& type,
+                                hidl_vec<uint8_t>& value) {
+  Error error = Error::NO_RESOURCES;
+  auto ret = mMapper->get(const_cast<native_handle_t*>(b), type,
+                          [&](Error e, const hidl_vec<uint8_t>& v) {
+                            error = e;
+                            value = v;
+                          });
+  if (!ret.isOk() || error != Error::NONE) {
+    ALOGE("Failed to get metadata %s of buffer %p", type.name.c_str(), b);
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc4Mapper::describe(buffer_handle_t b, BufferInfo& info) {
+  hidl_vec<uint8_t> value;
+  uint64_t width = 0, height = 0;
+  PixelFormat format = PixelFormat::RGBA_8888;
+  std::vector<PlaneLayout> layouts;
+
+  if (getMetadata(b, android::gralloc4::MetadataType_Width, value) < 0 ||
+      android::gralloc4::decodeWidth(value, &width) != android::NO_ERROR) {
+    return -1;
+  }
+  if (getMetadata(b, android::gralloc4::MetadataType_Height, value) < 0 ||
+      android::gralloc4::decodeHeight(value, &height) != android::NO_ERROR) {
+    return -1;
+  }
+  if (getMetadata(b, android::gralloc4::MetadataType_PixelFormatRequested,
+                  value) < 0 ||
+      android::gralloc4::decodePixelFormatRequested(value, &format) !=
+          android::NO_ERROR) {
+    return -1;
+  }
+  if (getMetadata(b, android::gralloc4::MetadataType_PlaneLayouts, value) <
+          0 ||
+      android::gralloc4::decodePlaneLayouts(value, &layouts) !=
+          android::NO_ERROR ||
+      layouts.empty()) {
+    return -1;
+  }
+
+  info.width = width;
+  info.height = height;
+  info.format = static_cast<int32_t>(format);
+  // in pixels of the first plane, like gralloc1 reports it
+  int64_t sampleBytes = layouts[0].sampleIncrementInBits / 8;
+  info.stride = layouts[0].strideInBytes / (sampleBytes > 0 ? sampleBytes : 1);
+  return 0;
+}
+
+int Gralloc4Mapper::getPlanes(buffer_handle_t b,
+                              std::vector<PlaneInfo>& planes) {
+  hidl_vec<uint8_t> value;
+  std::vector<PlaneLayout> layouts;
+  if (getMetadata(b, android::gralloc4::MetadataType_PlaneLayouts, value) <
+          0 ||
+      android::gralloc4::decodePlaneLayouts(value, &layouts) !=
+          android::NO_ERROR) {
+    return -1;
+  }
+
+  planes.clear();
+  for (auto& l : layouts) {
+    planes.push_back({(uint32_t)l.offsetInBytes, (uint32_t)l.strideInBytes,
+                      (uint32_t)l.widthInSamples,
+                      (uint32_t)l.heightInSamples});
+  }
+  return 0;
+}
+
+int Gralloc4Mapper::lock(buffer_handle_t b,
+                         uint32_t w,
+                         uint32_t h,
+                         uint8_t*& data) {
+  const uint64_t usage = static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN) |
+                         static_cast<uint64_t>(BufferUsage::CPU_WRITE_OFTEN);
+  IMapper::Rect region = {0, 0, (int32_t)w, (int32_t)h};
+  // the callers already waited for the buffer
+  hidl_handle acquireFence;
+  Error error = Error::NO_RESOURCES;
+  void* ptr = nullptr;
+  auto ret = mMapper->lock(const_cast<native_handle_t*>(b), usage, region,
+                           acquireFence, [&](Error e, void* d) {
+                             error = e;
+                             ptr = d;
+                           });
+  if (!ret.isOk() || error != Error::NONE) {
+    ALOGE("Failed to lock buffer %p", b);
+    return -1;
+  }
+  data = (uint8_t*)ptr;
+  return 0;
+}
+
+int Gralloc4Mapper::unlock(buffer_handle_t b) {
+  Error error = Error::NO_RESOURCES;
+  // the cpu access is over when unlock returns, the fence isn't needed
+  auto ret = mMapper->unlock(const_cast<native_handle_t*>(b),
+                             [&](Error e, const hidl_handle&) { error = e; });
+  if (!ret.isOk() || error != Error::NONE) {
+    ALOGE("Failed to unlock buffer %p", b);
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc4Mapper::importBuffer(buffer_handle_t b, buffer_handle_t* out) {
+  Error error = Error::NO_RESOURCES;
+  auto ret = mMapper->importBuffer(hidl_handle(b), [&](Error e, void* buffer) {
+    error = e;
+    *out = (buffer_handle_t)buffer;
+  });
+  if (!ret.isOk() || error != Error::NONE) {
+    ALOGE("Failed to import buffer %p", b);
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc4Mapper::release(buffer_handle_t b) {
+  auto ret = mMapper->freeBuffer(const_cast<native_handle_t*>(b));
+  if (!ret.isOk() || static_cast<Error>(ret) != Error::NONE) {
+    ALOGE("Failed to free buffer %p", b);
+    return -1;
+  }
+  return 0;
+}
+
+int Gralloc4Mapper::allocate(uint32_t width,
+                             uint32_t height,
+                             int32_t format,
+                             buffer_handle_t* out) {
+  if (!mAllocator) {
+    return -1;
+  }
+
+  IMapper::BufferDescriptorInfo descInfo;
+  descInfo.name = "hwc_vhal";
+  descInfo.width = width;
+  descInfo.height = height;
+  descInfo.layerCount = 1;
+  descInfo.format = static_cast<PixelFormat>(format);
+  descInfo.usage = static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN) |
+                   static_cast<uint64_t>(BufferUsage::CPU_WRITE_OFTEN);
+  descInfo.reservedSize = 0;
+
+  Error error = Error::NO_RESOURCES;
+  BufferDescriptor desc;
+  auto ret = mMapper->createDescriptor(
+      descInfo, [&](Error e, const BufferDescriptor& d) {
+        error = e;
+        desc = d;
+      });
+  if (!ret.isOk() || error != Error::NONE) {
+    ALOGE("Failed to create a buffer descriptor");
+    return -1;
+  }
+
+  int imported = -1;
+  auto allocRet = mAllocator->allocate(
+      desc, 1,
+      [&](Error e, uint32_t /*stride*/, const hidl_vec<hidl_handle>& buffers) {
+        // the raw handles only live for the callback
+        if (e == Error::NONE && buffers.size() == 1) {
+          imported = importBuffer(buffers[0].getNativeHandle(), out);
+        }
+      });
+  if (!allocRet.isOk() || imported < 0) {
+    ALOGE("Failed to allocate a %ux%u buffer of format %d", width, height,
+          format);
+    return -1;
+  }
+  return 0;
+}
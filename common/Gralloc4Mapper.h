@@ -0,0 +1,63 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __GRALLOC4_MAPPER_H__
+#define __GRALLOC4_MAPPER_H__
+
+#include <android/hardware/graphics/allocator/4.0/IAllocator.h>
+#include <android/hardware/graphics/mapper/4.0/IMapper.h>
+
+#include "IGrallocMapper.h"
+
+// IMapper 4.0, the buffer properties come from the standard metadata so
+// multi plane buffers get their real plane layouts.
+class Gralloc4Mapper : public IGrallocMapper {
+ public:
+  typedef android::hardware::graphics::mapper::V4_0::IMapper IMapper;
+  typedef android::hardware::graphics::allocator::V4_0::IAllocator IAllocator;
+
+  Gralloc4Mapper() {}
+  ~Gralloc4Mapper() {}
+
+  const char* name() const override { return "gralloc4"; }
+  int init() override;
+  int describe(buffer_handle_t b, BufferInfo& info) override;
+  int getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes) override;
+  int lock(buffer_handle_t b, uint32_t w, uint32_t h, uint8_t*& data) override;
+  int unlock(buffer_handle_t b) override;
+  int importBuffer(buffer_handle_t b, buffer_handle_t* out) override;
+  int release(buffer_handle_t b) override;
+  int allocate(uint32_t width,
+               uint32_t height,
+               int32_t format,
+               buffer_handle_t* out) override;
+
+ private:
+  int getMetadata(buffer_handle_t b,
+                  const IMapper::MetadataType& type,
+                  android::hardware::hidl_vec<uint8_t>& value);
+
+ private:
+  android::sp<IMapper> mMapper;
+  // only needed to allocate
+  android::sp<IAllocator> mAllocator;
+};
+
+#endif  // __GRALLOC4_MAPPER_H__
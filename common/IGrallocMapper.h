@@ -0,0 +1,87 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __IGRALLOC_MAPPER_H__
+#define __IGRALLOC_MAPPER_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <cutils/native_handle.h>
+#include <system/graphics.h>
+
+// A way to reach buffer memory, BufferMapper picks one at startup. Handles
+// given to describe, getPlanes and lock must come from importBuffer, only
+// gralloc1 accepts others.
+struct IGrallocMapper {
+  struct BufferInfo {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;  // in pixels
+    int32_t format;
+  };
+  // offsets and strides in bytes, width and height in samples of the plane
+  struct PlaneInfo {
+    uint32_t offset;
+    uint32_t stride;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  // of the single plane formats, 0 for the others
+  static uint32_t bytesPerPixel(int32_t format) {
+    switch (format) {
+      case HAL_PIXEL_FORMAT_RGBA_8888:
+      case HAL_PIXEL_FORMAT_RGBX_8888:
+      case HAL_PIXEL_FORMAT_BGRA_8888:
+        return 4;
+      case HAL_PIXEL_FORMAT_RGB_888:
+        return 3;
+      case HAL_PIXEL_FORMAT_RGB_565:
+        return 2;
+      default:
+        return 0;
+    }
+  }
+
+  virtual ~IGrallocMapper() {}
+  virtual const char* name() const = 0;
+  // -1 if the backend isn't available on this image
+  virtual int init() = 0;
+  virtual int describe(buffer_handle_t b, BufferInfo& info) = 0;
+  virtual int getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes) = 0;
+  // cpu read and write mapping of the w x h area
+  virtual int lock(buffer_handle_t b,
+                   uint32_t w,
+                   uint32_t h,
+                   uint8_t*& data) = 0;
+  virtual int unlock(buffer_handle_t b) = 0;
+  virtual int importBuffer(buffer_handle_t b, buffer_handle_t* out) = 0;
+  virtual int release(buffer_handle_t b) = 0;
+  // a buffer for cpu access owned by the hwc, returned imported and freed
+  // with release
+  virtual int allocate(uint32_t width,
+                       uint32_t height,
+                       int32_t format,
+                       buffer_handle_t* out) = 0;
+};
+
+#endif  // __IGRALLOC_MAPPER_H__
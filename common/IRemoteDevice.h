@@ -44,8 +44,16 @@ struct DisplayStatusListener {
 
 struct DisplayEventListener {
   virtual ~DisplayEventListener(){};
-  virtual int onBufferDisplayed(const buffer_info_t& info) = 0;
-  virtual int onPresented(std::vector<layer_buffer_info_t>& layerBuffer, int& fence) = 0;
+  // frame is the number given to RemoteDisplay::beginFrame
+  virtual int onBufferDisplayed(uint32_t frame, const buffer_info_t& info) = 0;
+  // takes ownership of the fences, fence is -1 if there is none
+  virtual int onPresented(uint32_t frame,
+                          std::vector<layer_buffer_info_t>& layerBuffer,
+                          int& fence) = 0;
+  // all frames up to this one have been acked
+  virtual int onFramesAcked(uint32_t frame) = 0;
+  // timestamp is CLOCK_MONOTONIC ns, period 0 if unknown
+  virtual int onVsync(int64_t timestamp, uint32_t period) = 0;
 };
 
 #endif  //__IREMOTE_DEVICE_H__
@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+
+#include <cutils/log.h>
+
+#include "IdleTimer.h"
+
+IdleTimer::~IdleTimer() {
+  stop();
+}
+
+int IdleTimer::start(uint32_t timeoutMs, Callback cb) {
+  ALOGV("IdleTimer::%s:timeout=%u", __func__, timeoutMs);
+
+  if (mThread || timeoutMs == 0)
+    return -1;
+
+  mCallback = cb;
+  mTimeout = std::chrono::milliseconds(timeoutMs);
+  mStop = false;
+  mArmed = false;
+  mThread = std::unique_ptr<std::thread>(
+      new std::thread(&IdleTimer::threadProc, this));
+  return 0;
+}
+
+void IdleTimer::stop() {
+  if (!mThread)
+    return;
+
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mMutex);
+    mStop = true;
+  }
+  mCond.notify_all();
+  mThread->join();
+  mThread = nullptr;
+}
+
+void IdleTimer::reset() {
+  if (!mThread)
+    return;
+
+  bool wasArmed;
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mMutex);
+    mDeadline = std::chrono::steady_clock::now() + mTimeout;
+    wasArmed = mArmed;
+    mArmed = true;
+  }
+  if (!wasArmed) {
+    mCond.notify_all();
+  }
+}
+
+void IdleTimer::threadProc() {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  while (!mStop) {
+    if (!mArmed) {
+      mCond.wait(lk);
+      continue;
+    }
+    mCond.wait_until(lk, mDeadline);
+    if (mStop || !mArmed || std::chrono::steady_clock::now() < mDeadline)
+      continue;
+
+    mArmed = false;
+    lk.unlock();
+    if (mCallback) {
+      mCallback();
+    }
+    lk.lock();
+  }
+}
@@ -0,0 +1,61 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __IDLE_TIMER_H__
+#define __IDLE_TIMER_H__
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// One-shot timer restarted on each frame, the callback runs on the timer
+// thread once no frame came for the timeout. Restarting only moves the
+// deadline, the thread wakes up at most once per timeout.
+class IdleTimer {
+ public:
+  typedef std::function<void()> Callback;
+
+  IdleTimer() {}
+  ~IdleTimer();
+
+  int start(uint32_t timeoutMs, Callback cb);
+  void stop();
+  void reset();
+
+ private:
+  void threadProc();
+
+ private:
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  std::unique_ptr<std::thread> mThread;
+  Callback mCallback;
+  std::chrono::milliseconds mTimeout{0};
+  std::chrono::steady_clock::time_point mDeadline;
+  bool mArmed = false;
+  bool mStop = false;
+};
+
+#endif  // __IDLE_TIMER_H__
@@ -0,0 +1,196 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "MemfdMapper.h"
+
+namespace {
+
+// handle ints: magic, width, height, stride in pixels, format
+const int kMagic = 0x6d656d66;
+const int kNumInts = 5;
+const uint32_t kStrideAlign = 32;
+
+}  // namespace
+
+MemfdMapper::~MemfdMapper() {
+  for (auto& m : mMappings) {
+    munmap(m.second.first, m.second.second);
+  }
+}
+
+int MemfdMapper::allocate(uint32_t width,
+                          uint32_t height,
+                          int32_t format,
+                          buffer_handle_t* out) {
+  if (!width || !height ||
+      (!bytesPerPixel(format) && format != HAL_PIXEL_FORMAT_YCBCR_420_888)) {
+    ALOGE("%s: can't allocate %ux%u format %d", __func__, width, height,
+          format);
+    return -1;
+  }
+
+  native_handle_t* h = native_handle_create(1, kNumInts);
+  if (!h) {
+    return -1;
+  }
+  h->data[0] = syscall(__NR_memfd_create, "hwc_vhal_buffer", 1 /*CLOEXEC*/);
+  h->data[1] = kMagic;
+  h->data[2] = width;
+  h->data[3] = height;
+  h->data[4] = (width + kStrideAlign - 1) & ~(kStrideAlign - 1);
+  h->data[5] = format;
+
+  BufferInfo info;
+  std::vector<PlaneInfo> planes;
+  size_t size = 0;
+  if (h->data[0] < 0 || getLayout(h, info, planes, size) < 0 ||
+      ftruncate(h->data[0], size) < 0) {
+    ALOGE("%s: failed to create memfd:%s", __func__, strerror(errno));
+    native_handle_close(h);
+    native_handle_delete(h);
+    return -1;
+  }
+  *out = h;
+  return 0;
+}
+
+void MemfdMapper::freeBuffer(buffer_handle_t b) {
+  if (!b)
+    return;
+  native_handle_close(b);
+  native_handle_delete(const_cast<native_handle_t*>(b));
+}
+
+int MemfdMapper::getLayout(buffer_handle_t b,
+                           BufferInfo& info,
+                           std::vector<PlaneInfo>& planes,
+                           size_t& size) {
+  if (!b || b->numFds != 1 || b->numInts != kNumInts ||
+      b->data[1] != kMagic) {
+    ALOGE("Buffer %p isn't a memfd buffer", b);
+    return -1;
+  }
+
+  info.width = b->data[2];
+  info.height = b->data[3];
+  info.stride = b->data[4];
+  info.format = b->data[5];
+
+  uint32_t bpp = bytesPerPixel(info.format);
+  if (bpp) {
+    planes.assign(1, {0, info.stride * bpp, info.width, info.height});
+    size = (size_t)info.stride * bpp * info.height;
+    return 0;
+  }
+
+  // Y then U then V, chroma at half resolution
+  uint32_t lumaSize = info.stride * info.height;
+  uint32_t chromaStride = info.stride / 2;
+  uint32_t chromaW = (info.width + 1) / 2;
+  uint32_t chromaH = (info.height + 1) / 2;
+  planes.clear();
+  planes.push_back({0, info.stride, info.width, info.height});
+  planes.push_back({lumaSize, chromaStride, chromaW, chromaH});
+  planes.push_back(
+      {lumaSize + chromaStride * chromaH, chromaStride, chromaW, chromaH});
+  size = lumaSize + 2 * chromaStride * chromaH;
+  return 0;
+}
+
+int MemfdMapper::describe(buffer_handle_t b, BufferInfo& info) {
+  std::vector<PlaneInfo> planes;
+  size_t size;
+  return getLayout(b, info, planes, size);
+}
+
+int MemfdMapper::getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes) {
+  BufferInfo info;
+  size_t size;
+  return getLayout(b, info, planes, size);
+}
+
+int MemfdMapper::lock(buffer_handle_t b,
+                      uint32_t w,
+                      uint32_t h,
+                      uint8_t*& data) {
+  BufferInfo info;
+  std::vector<PlaneInfo> planes;
+  size_t size;
+  if (getLayout(b, info, planes, size) < 0) {
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto it = mMappings.find(b);
+  if (it != mMappings.end()) {
+    data = it->second.first;
+    return 0;
+  }
+  void* addr =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, b->data[0], 0);
+  if (addr == MAP_FAILED) {
+    ALOGE("Failed to map buffer %p:%s", b, strerror(errno));
+    return -1;
+  }
+  data = (uint8_t*)addr;
+  mMappings[b] = std::make_pair(data, size);
+  return 0;
+}
+
+int MemfdMapper::unlock(buffer_handle_t b) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto it = mMappings.find(b);
+  if (it == mMappings.end()) {
+    return -1;
+  }
+  munmap(it->second.first, it->second.second);
+  mMappings.erase(it);
+  return 0;
+}
+
+int MemfdMapper::importBuffer(buffer_handle_t b, buffer_handle_t* out) {
+  BufferInfo info;
+  std::vector<PlaneInfo> planes;
+  size_t size;
+  if (getLayout(b, info, planes, size) < 0) {
+    return -1;
+  }
+  native_handle_t* h = native_handle_clone(b);
+  if (!h) {
+    return -1;
+  }
+  *out = h;
+  return 0;
+}
+
+int MemfdMapper::release(buffer_handle_t b) {
+  unlock(b);
+  freeBuffer(b);
+  return 0;
+}
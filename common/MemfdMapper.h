@@ -0,0 +1,64 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __MEMFD_MAPPER_H__
+#define __MEMFD_MAPPER_H__
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "IGrallocMapper.h"
+
+// Buffers in memfds described by the handle itself, for running the mapping
+// paths without gralloc, e.g. on a host. It only understands the buffers it
+// allocates: single plane formats and YCBCR_420_888 as three planes.
+class MemfdMapper : public IGrallocMapper {
+ public:
+  MemfdMapper() {}
+  ~MemfdMapper();
+
+  const char* name() const override { return "memfd"; }
+  int init() override { return 0; }
+  int describe(buffer_handle_t b, BufferInfo& info) override;
+  int getPlanes(buffer_handle_t b, std::vector<PlaneInfo>& planes) override;
+  int lock(buffer_handle_t b, uint32_t w, uint32_t h, uint8_t*& data) override;
+  int unlock(buffer_handle_t b) override;
+  int importBuffer(buffer_handle_t b, buffer_handle_t* out) override;
+  int release(buffer_handle_t b) override;
+  int allocate(uint32_t width,
+               uint32_t height,
+               int32_t format,
+               buffer_handle_t* out) override;
+
+ private:
+  static void freeBuffer(buffer_handle_t b);
+  static int getLayout(buffer_handle_t b,
+                       BufferInfo& info,
+                       std::vector<PlaneInfo>& planes,
+                       size_t& size);
+
+ private:
+  std::mutex mMutex;
+  // locked buffers and their mappings
+  std::map<buffer_handle_t, std::pair<uint8_t*, size_t>> mMappings;
+};
+
+#endif  // __MEMFD_MAPPER_H__
@@ -0,0 +1,885 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#include "PixelKernels.h"
+
+namespace {
+
+// rows shorter than this are left to memcpy, streaming them isn't worth it
+const size_t kStreamThreshold = 256;
+
+inline uint32_t load32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void store32(uint8_t* p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+inline uint8_t avg(uint8_t a, uint8_t b) {
+  return (a + b + 1) >> 1;
+}
+
+inline uint8_t luma(const uint8_t* p) {
+  return ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+}
+
+// chroma of the 2x2 block at p0 (row 0) and p1 (row 1), the right column is
+// given by the offset so the last odd column can reuse the left one
+inline void chroma(const uint8_t* p0,
+                   const uint8_t* p1,
+                   uint32_t right,
+                   uint8_t* u,
+                   uint8_t* v) {
+  int c[3];
+  for (int i = 0; i < 3; i++) {
+    c[i] = avg(avg(p0[i], p1[i]), avg(p0[right + i], p1[right + i]));
+  }
+  *u = ((-38 * c[0] - 74 * c[1] + 112 * c[2] + 128) >> 8) + 128;
+  *v = ((112 * c[0] - 94 * c[1] - 18 * c[2] + 128) >> 8) + 128;
+}
+
+// x / 255 rounded for x up to 255 * 255, as the SIMD versions compute it
+inline uint32_t div255(uint32_t x) {
+  return ((x + 128) * 257) >> 16;
+}
+
+// the color channels are scaled by m, the plane alpha when src is
+// premultiplied and the combined alpha when not
+inline uint32_t blendPixel(uint32_t s, uint32_t d, uint32_t pa, bool premult) {
+  uint32_t a = div255((s >> 24) * pa);
+  uint32_t m = premult ? pa : a;
+  uint32_t out = 0;
+  for (int i = 0; i < 32; i += 8) {
+    uint32_t sc = i == 24 ? div255(a * 255) : div255(((s >> i) & 0xff) * m);
+    uint32_t c = sc + div255(((d >> i) & 0xff) * (255 - a));
+    out |= (c > 255 ? 255 : c) << i;
+  }
+  return out;
+}
+
+// Each SIMD row kernel does the pixels it can and returns how many, the
+// scalar ones finish the row.
+struct KernelTable {
+  PixelKernels::Isa isa;
+  const char* name;
+  void (*copyRow)(uint8_t* dst, const uint8_t* src, size_t len);
+  void (*copyDone)();
+  uint32_t (*swizzleRow)(uint8_t* dst, const uint8_t* src, uint32_t n);
+  uint32_t (*alphaRow)(uint8_t* dst, const uint8_t* src, uint32_t n);
+  uint32_t (*lumaRow)(uint8_t* y, const uint8_t* src, uint32_t n);
+  // n is the number of chroma samples, step the distance between them
+  uint32_t (*chromaRow)(uint8_t* u,
+                        uint8_t* v,
+                        uint32_t step,
+                        const uint8_t* row0,
+                        const uint8_t* row1,
+                        uint32_t n);
+  uint32_t (*fillRow)(uint8_t* dst, uint32_t color, uint32_t n);
+  uint32_t (*blendRow)(uint8_t* dst,
+                       const uint8_t* src,
+                       uint32_t n,
+                       uint32_t alpha,
+                       bool premultiplied);
+  // rotates the src area whose width and height are multiples of 4 and
+  // returns false if it doesn't do it
+  bool (*rotateBlocks)(uint8_t* dst,
+                       uint32_t dstStride,
+                       const uint8_t* src,
+                       uint32_t srcStride,
+                       uint32_t width,
+                       uint32_t height,
+                       uint32_t blocksW,
+                       uint32_t blocksH,
+                       int degrees);
+};
+
+void copyRowScalar(uint8_t* dst, const uint8_t* src, size_t len) {
+  memcpy(dst, src, len);
+}
+
+void copyDoneScalar() {}
+
+uint32_t noneRow(uint8_t*, const uint8_t*, uint32_t) {
+  return 0;
+}
+
+uint32_t noneChromaRow(uint8_t*,
+                       uint8_t*,
+                       uint32_t,
+                       const uint8_t*,
+                       const uint8_t*,
+                       uint32_t) {
+  return 0;
+}
+
+uint32_t noneFillRow(uint8_t*, uint32_t, uint32_t) {
+  return 0;
+}
+
+uint32_t noneBlendRow(uint8_t*, const uint8_t*, uint32_t, uint32_t, bool) {
+  return 0;
+}
+
+bool noneRotateBlocks(uint8_t*,
+                      uint32_t,
+                      const uint8_t*,
+                      uint32_t,
+                      uint32_t,
+                      uint32_t,
+                      uint32_t,
+                      uint32_t,
+                      int) {
+  return false;
+}
+
+const KernelTable kScalarKernels = {
+    PixelKernels::ISA_SCALAR,
+    "scalar",
+    copyRowScalar,
+    copyDoneScalar,
+    noneRow,
+    noneRow,
+    noneRow,
+    noneChromaRow,
+    noneFillRow,
+    noneBlendRow,
+    noneRotateBlocks,
+};
+
+#ifdef PIXEL_KERNELS_X86
+
+__attribute__((target("sse4.1"))) void copyRowSse4(uint8_t* dst,
+                                                  const uint8_t* src,
+                                                  size_t len) {
+  if (len < kStreamThreshold) {
+    memcpy(dst, src, len);
+    return;
+  }
+  size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  len -= head;
+  for (; len >= 64; len -= 64, dst += 64, src += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)src);
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+    _mm_stream_si128((__m128i*)dst, a);
+    _mm_stream_si128((__m128i*)(dst + 16), b);
+    _mm_stream_si128((__m128i*)(dst + 32), c);
+    _mm_stream_si128((__m128i*)(dst + 48), d);
+  }
+  for (; len >= 16; len -= 16, dst += 16, src += 16) {
+    _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+  }
+  memcpy(dst, src, len);
+}
+
+// streamed stores are weakly ordered, make them visible before the frame is
+// published
+__attribute__((target("sse4.1"))) void copyDoneSse4() {
+  _mm_sfence();
+}
+
+__attribute__((target("sse4.1"))) uint32_t swizzleRowSse4(uint8_t* dst,
+                                                         const uint8_t* src,
+                                                         uint32_t n) {
+  const __m128i mask =
+      _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(p, mask));
+  }
+  return i;
+}
+
+__attribute__((target("sse4.1"))) uint32_t alphaRowSse4(uint8_t* dst,
+                                                       const uint8_t* src,
+                                                       uint32_t n) {
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(p, alpha));
+  }
+  return i;
+}
+
+// 4 RGBA pixels to 4 int32 of r*c0 + g*c1 + b*c2 + 128
+__attribute__((target("sse4.1"))) inline __m128i dot4Sse4(__m128i p,
+                                                         __m128i coef) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(128);
+  __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), coef);
+  __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), coef);
+  return _mm_add_epi32(_mm_hadd_epi32(lo, hi), round);
+}
+
+__attribute__((target("sse4.1"))) uint32_t lumaRowSse4(uint8_t* y,
+                                                      const uint8_t* src,
+                                                      uint32_t n) {
+  const __m128i coef = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+  const __m128i offset = _mm_set1_epi16(16);
+  uint32_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const uint8_t* p = src + i * 4;
+    __m128i a = _mm_srai_epi32(
+        dot4Sse4(_mm_loadu_si128((const __m128i*)p), coef), 8);
+    __m128i b = _mm_srai_epi32(
+        dot4Sse4(_mm_loadu_si128((const __m128i*)(p + 16)), coef), 8);
+    __m128i c = _mm_srai_epi32(
+        dot4Sse4(_mm_loadu_si128((const __m128i*)(p + 32)), coef), 8);
+    __m128i d = _mm_srai_epi32(
+        dot4Sse4(_mm_loadu_si128((const __m128i*)(p + 48)), coef), 8);
+    __m128i ab = _mm_add_epi16(_mm_packs_epi32(a, b), offset);
+    __m128i cd = _mm_add_epi16(_mm_packs_epi32(c, d), offset);
+    _mm_storeu_si128((__m128i*)(y + i), _mm_packus_epi16(ab, cd));
+  }
+  return i;
+}
+
+// 8 pixels of 2 rows to 4 chroma samples as RGBA
+__attribute__((target("sse4.1"))) inline __m128i subsampleSse4(
+    const uint8_t* row0,
+    const uint8_t* row1) {
+  __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)row0),
+                           _mm_loadu_si128((const __m128i*)row1));
+  __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + 16)),
+                           _mm_loadu_si128((const __m128i*)(row1 + 16)));
+  // even pixels get the average with their right neighbour
+  a = _mm_avg_epu8(a, _mm_srli_si128(a, 4));
+  b = _mm_avg_epu8(b, _mm_srli_si128(b, 4));
+  a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+  b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+  return _mm_unpacklo_epi64(a, b);
+}
+
+// 4 chroma samples as RGBA to U0..U3 V0..V3 in the low 8 bytes
+__attribute__((target("sse4.1"))) inline __m128i chroma4Sse4(__m128i c) {
+  const __m128i coefU = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+  const __m128i coefV = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+  const __m128i offset = _mm_set1_epi16(128);
+  __m128i u = _mm_srai_epi32(dot4Sse4(c, coefU), 8);
+  __m128i v = _mm_srai_epi32(dot4Sse4(c, coefV), 8);
+  __m128i uv = _mm_add_epi16(_mm_packs_epi32(u, v), offset);
+  return _mm_packus_epi16(uv, uv);
+}
+
+__attribute__((target("sse4.1"))) inline void storeChroma4Sse4(uint8_t* u,
+                                                              uint8_t* v,
+                                                              uint32_t step,
+                                                              __m128i uv) {
+  if (step == 2 && v == u + 1) {
+    const __m128i interleave =
+        _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 0, 4, 1, 5, 2, 6, 3, 7);
+    _mm_storel_epi64((__m128i*)u, _mm_shuffle_epi8(uv, interleave));
+  } else if (step == 1) {
+    store32(u, _mm_cvtsi128_si32(uv));
+    store32(v, _mm_cvtsi128_si32(_mm_srli_si128(uv, 4)));
+  } else {
+    uint8_t b[8];
+    _mm_storel_epi64((__m128i*)b, uv);
+    for (int i = 0; i < 4; i++) {
+      u[i * step] = b[i];
+      v[i * step] = b[4 + i];
+    }
+  }
+}
+
+__attribute__((target("sse4.1"))) uint32_t chromaRowSse4(uint8_t* u,
+                                                        uint8_t* v,
+                                                        uint32_t step,
+                                                        const uint8_t* row0,
+                                                        const uint8_t* row1,
+                                                        uint32_t n) {
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i c = subsampleSse4(row0 + i * 8, row1 + i * 8);
+    storeChroma4Sse4(u + i * step, v + i * step, step, chroma4Sse4(c));
+  }
+  return i;
+}
+
+__attribute__((target("sse4.1"))) uint32_t fillRowSse4(uint8_t* dst,
+                                                      uint32_t color,
+                                                      uint32_t n) {
+  const __m128i c = _mm_set1_epi32(color);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_si128((__m128i*)(dst + i * 4), c);
+  }
+  return i;
+}
+
+// 2 pixels as 16 bit lanes blended, see blendPixel
+__attribute__((target("sse4.1"))) inline __m128i blend2Sse4(__m128i s,
+                                                           __m128i d,
+                                                           __m128i pa,
+                                                           bool premult) {
+  const __m128i round = _mm_set1_epi16(128);
+  const __m128i scale = _mm_set1_epi16(257);
+  const __m128i full = _mm_set1_epi16(255);
+  __m128i sa = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i a = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(sa, pa), round),
+                              scale);
+  // the alpha lanes take a scaled by 255, which is a
+  __m128i m = _mm_blend_epi16(premult ? pa : a, full, 0x88);
+  __m128i sv = _mm_blend_epi16(s, a, 0x88);
+  __m128i sc = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(sv, m), round),
+                               scale);
+  __m128i dc = _mm_mulhi_epu16(
+      _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(full, a)), round), scale);
+  return _mm_adds_epu16(sc, dc);
+}
+
+__attribute__((target("sse4.1"))) uint32_t blendRowSse4(uint8_t* dst,
+                                                       const uint8_t* src,
+                                                       uint32_t n,
+                                                       uint32_t alpha,
+                                                       bool premultiplied) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i pa = _mm_set1_epi16(alpha);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+    __m128i lo = blend2Sse4(_mm_unpacklo_epi8(s, zero),
+                            _mm_unpacklo_epi8(d, zero), pa, premultiplied);
+    __m128i hi = blend2Sse4(_mm_unpackhi_epi8(s, zero),
+                            _mm_unpackhi_epi8(d, zero), pa, premultiplied);
+    _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+  }
+  return i;
+}
+
+__attribute__((target("sse4.1"))) inline void transpose4Sse4(__m128i& r0,
+                                                            __m128i& r1,
+                                                            __m128i& r2,
+                                                            __m128i& r3) {
+  __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+  __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+  __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+  __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+  r0 = _mm_unpacklo_epi64(t0, t1);
+  r1 = _mm_unpackhi_epi64(t0, t1);
+  r2 = _mm_unpacklo_epi64(t2, t3);
+  r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+__attribute__((target("sse4.1"))) bool rotateBlocksSse4(uint8_t* dst,
+                                                       uint32_t dstStride,
+                                                       const uint8_t* src,
+                                                       uint32_t srcStride,
+                                                       uint32_t width,
+                                                       uint32_t height,
+                                                       uint32_t blocksW,
+                                                       uint32_t blocksH,
+                                                       int degrees) {
+  if (degrees == 180) {
+    for (uint32_t y = 0; y < blocksH; y++) {
+      const uint8_t* s = src + y * srcStride;
+      uint8_t* d = dst + (height - 1 - y) * dstStride;
+      for (uint32_t x = 0; x < blocksW; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(s + x * 4));
+        _mm_storeu_si128((__m128i*)(d + (width - 4 - x) * 4),
+                         _mm_shuffle_epi32(p, _MM_SHUFFLE(0, 1, 2, 3)));
+      }
+    }
+    return true;
+  }
+  if (degrees != 90 && degrees != 270)
+    return false;
+
+  for (uint32_t by = 0; by < blocksH; by += 4) {
+    for (uint32_t bx = 0; bx < blocksW; bx += 4) {
+      const uint8_t* s = src + by * srcStride + bx * 4;
+      __m128i r[4];
+      for (int k = 0; k < 4; k++) {
+        // for 90 the bottom row of the block ends up on the left
+        int row = degrees == 90 ? 3 - k : k;
+        r[k] = _mm_loadu_si128((const __m128i*)(s + row * srcStride));
+      }
+      transpose4Sse4(r[0], r[1], r[2], r[3]);
+      for (int i = 0; i < 4; i++) {
+        uint32_t dy = degrees == 90 ? bx + i : width - 1 - (bx + i);
+        uint32_t dx = degrees == 90 ? height - 4 - by : by;
+        _mm_storeu_si128((__m128i*)(dst + dy * dstStride + dx * 4), r[i]);
+      }
+    }
+  }
+  return true;
+}
+
+const KernelTable kSse4Kernels = {
+    PixelKernels::ISA_SSE4,
+    "sse4",
+    copyRowSse4,
+    copyDoneSse4,
+    swizzleRowSse4,
+    alphaRowSse4,
+    lumaRowSse4,
+    chromaRowSse4,
+    fillRowSse4,
+    blendRowSse4,
+    rotateBlocksSse4,
+};
+
+__attribute__((target("avx2"))) void copyRowAvx2(uint8_t* dst,
+                                                const uint8_t* src,
+                                                size_t len) {
+  if (len < kStreamThreshold) {
+    memcpy(dst, src, len);
+    return;
+  }
+  size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  len -= head;
+  for (; len >= 128; len -= 128, dst += 128, src += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)src);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+    _mm256_stream_si256((__m256i*)dst, a);
+    _mm256_stream_si256((__m256i*)(dst + 32), b);
+    _mm256_stream_si256((__m256i*)(dst + 64), c);
+    _mm256_stream_si256((__m256i*)(dst + 96), d);
+  }
+  for (; len >= 32; len -= 32, dst += 32, src += 32) {
+    _mm256_stream_si256((__m256i*)dst,
+                        _mm256_loadu_si256((const __m256i*)src));
+  }
+  memcpy(dst, src, len);
+}
+
+__attribute__((target("avx2"))) void copyDoneAvx2() {
+  _mm_sfence();
+  _mm256_zeroupper();
+}
+
+__attribute__((target("avx2"))) uint32_t swizzleRowAvx2(uint8_t* dst,
+                                                       const uint8_t* src,
+                                                       uint32_t n) {
+  const __m256i mask = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5,
+      4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+    _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_shuffle_epi8(p, mask));
+  }
+  _mm256_zeroupper();
+  return i;
+}
+
+__attribute__((target("avx2"))) uint32_t alphaRowAvx2(uint8_t* dst,
+                                                     const uint8_t* src,
+                                                     uint32_t n) {
+  const __m256i alpha = _mm256_set1_epi32(0xff000000);
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+    _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_or_si256(p, alpha));
+  }
+  _mm256_zeroupper();
+  return i;
+}
+
+__attribute__((target("avx2"))) inline __m256i dot8Avx2(__m256i p,
+                                                       __m256i coef) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(128);
+  __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(p, zero), coef);
+  __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(p, zero), coef);
+  // per 128 bit lane, so pixels come out as 0 1 2 3 4 5 6 7
+  return _mm256_add_epi32(_mm256_hadd_epi32(lo, hi), round);
+}
+
+__attribute__((target("avx2"))) uint32_t lumaRowAvx2(uint8_t* y,
+                                                    const uint8_t* src,
+                                                    uint32_t n) {
+  const __m256i coef = _mm256_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0, 66,
+                                         129, 25, 0, 66, 129, 25, 0);
+  const __m256i offset = _mm256_set1_epi16(16);
+  // undoes the lane interleaving of the two packs
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  uint32_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const uint8_t* p = src + i * 4;
+    __m256i a = _mm256_srai_epi32(
+        dot8Avx2(_mm256_loadu_si256((const __m256i*)p), coef), 8);
+    __m256i b = _mm256_srai_epi32(
+        dot8Avx2(_mm256_loadu_si256((const __m256i*)(p + 32)), coef), 8);
+    __m256i c = _mm256_srai_epi32(
+        dot8Avx2(_mm256_loadu_si256((const __m256i*)(p + 64)), coef), 8);
+    __m256i d = _mm256_srai_epi32(
+        dot8Avx2(_mm256_loadu_si256((const __m256i*)(p + 96)), coef), 8);
+    __m256i ab = _mm256_add_epi16(_mm256_packs_epi32(a, b), offset);
+    __m256i cd = _mm256_add_epi16(_mm256_packs_epi32(c, d), offset);
+    __m256i out = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd),
+                                              order);
+    _mm256_storeu_si256((__m256i*)(y + i), out);
+  }
+  _mm256_zeroupper();
+  return i;
+}
+
+__attribute__((target("avx2"))) uint32_t fillRowAvx2(uint8_t* dst,
+                                                    uint32_t color,
+                                                    uint32_t n) {
+  const __m256i c = _mm256_set1_epi32(color);
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i*)(dst + i * 4), c);
+  }
+  _mm256_zeroupper();
+  return i;
+}
+
+__attribute__((target("avx2"))) inline __m256i blend4Avx2(__m256i s,
+                                                         __m256i d,
+                                                         __m256i pa,
+                                                         bool premult) {
+  const __m256i round = _mm256_set1_epi16(128);
+  const __m256i scale = _mm256_set1_epi16(257);
+  const __m256i full = _mm256_set1_epi16(255);
+  __m256i sa = _mm256_shufflehi_epi16(
+      _mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)),
+      _MM_SHUFFLE(3, 3, 3, 3));
+  __m256i a = _mm256_mulhi_epu16(
+      _mm256_add_epi16(_mm256_mullo_epi16(sa, pa), round), scale);
+  __m256i m = _mm256_blend_epi16(premult ? pa : a, full, 0x88);
+  __m256i sv = _mm256_blend_epi16(s, a, 0x88);
+  __m256i sc = _mm256_mulhi_epu16(
+      _mm256_add_epi16(_mm256_mullo_epi16(sv, m), round), scale);
+  __m256i dc = _mm256_mulhi_epu16(
+      _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(full, a)),
+                       round),
+      scale);
+  return _mm256_adds_epu16(sc, dc);
+}
+
+__attribute__((target("avx2"))) uint32_t blendRowAvx2(uint8_t* dst,
+                                                     const uint8_t* src,
+                                                     uint32_t n,
+                                                     uint32_t alpha,
+                                                     bool premultiplied) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i pa = _mm256_set1_epi16(alpha);
+  uint32_t i = 0;
+  // unpack and pack work within 128 bit lanes, so pixels keep their order
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i * 4));
+    __m256i lo = blend4Avx2(_mm256_unpacklo_epi8(s, zero),
+                            _mm256_unpacklo_epi8(d, zero), pa, premultiplied);
+    __m256i hi = blend4Avx2(_mm256_unpackhi_epi8(s, zero),
+                            _mm256_unpackhi_epi8(d, zero), pa, premultiplied);
+    _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_packus_epi16(lo, hi));
+  }
+  _mm256_zeroupper();
+  return i;
+}
+
+const KernelTable kAvx2Kernels = {
+    PixelKernels::ISA_AVX2,
+    "avx2",
+    copyRowAvx2,
+    copyDoneAvx2,
+    swizzleRowAvx2,
+    alphaRowAvx2,
+    lumaRowAvx2,
+    // chroma is a quarter of the work and rotation is bound by the scattered
+    // stores, the SSE versions are as fast there
+    chromaRowSse4,
+    fillRowAvx2,
+    blendRowAvx2,
+    rotateBlocksSse4,
+};
+
+#endif  // PIXEL_KERNELS_X86
+
+const KernelTable* selectKernels() {
+  PixelKernels::Isa max = PixelKernels::ISA_AVX2;
+  char value[PROPERTY_VALUE_MAX];
+  if (property_get("hwc_vhal.pixel_isa", value, nullptr) > 0) {
+    if (!strcmp(value, "scalar"))
+      max = PixelKernels::ISA_SCALAR;
+    else if (!strcmp(value, "sse4"))
+      max = PixelKernels::ISA_SSE4;
+  }
+
+  const KernelTable* kernels = &kScalarKernels;
+#ifdef PIXEL_KERNELS_X86
+  __builtin_cpu_init();
+  if (max >= PixelKernels::ISA_AVX2 && __builtin_cpu_supports("avx2"))
+    kernels = &kAvx2Kernels;
+  else if (max >= PixelKernels::ISA_SSE4 && __builtin_cpu_supports("sse4.1"))
+    kernels = &kSse4Kernels;
+#endif
+  ALOGI("Pixel kernels: %s", kernels->name);
+  return kernels;
+}
+
+const KernelTable& kernels() {
+  static const KernelTable* sKernels = selectKernels();
+  return *sKernels;
+}
+
+void rotatePixel(uint8_t* dst,
+                 uint32_t dstStride,
+                 const uint8_t* src,
+                 uint32_t srcStride,
+                 uint32_t width,
+                 uint32_t height,
+                 uint32_t x,
+                 uint32_t y,
+                 int degrees) {
+  uint32_t dx = x, dy = y;
+  switch (degrees) {
+    case 90:
+      dx = height - 1 - y;
+      dy = x;
+      break;
+    case 180:
+      dx = width - 1 - x;
+      dy = height - 1 - y;
+      break;
+    case 270:
+      dx = y;
+      dy = width - 1 - x;
+      break;
+  }
+  store32(dst + dy * dstStride + dx * 4, load32(src + y * srcStride + x * 4));
+}
+
+}  // namespace
+
+PixelKernels::Isa PixelKernels::isa() {
+  return kernels().isa;
+}
+
+const char* PixelKernels::isaName() {
+  return kernels().name;
+}
+
+void PixelKernels::copy(uint8_t* dst,
+                        uint32_t dstStride,
+                        const uint8_t* src,
+                        uint32_t srcStride,
+                        uint32_t width,
+                        uint32_t height) {
+  auto& k = kernels();
+  size_t len = width * 4;
+  if (dstStride == srcStride && srcStride == len) {
+    k.copyRow(dst, src, len * height);
+  } else {
+    for (uint32_t i = 0; i < height; i++) {
+      k.copyRow(dst + i * dstStride, src + i * srcStride, len);
+    }
+  }
+  k.copyDone();
+}
+
+void PixelKernels::swizzle(uint8_t* dst,
+                           uint32_t dstStride,
+                           const uint8_t* src,
+                           uint32_t srcStride,
+                           uint32_t width,
+                           uint32_t height) {
+  auto& k = kernels();
+  for (uint32_t y = 0; y < height; y++) {
+    uint8_t* d = dst + y * dstStride;
+    const uint8_t* s = src + y * srcStride;
+    for (uint32_t x = k.swizzleRow(d, s, width); x < width; x++) {
+      uint32_t p = load32(s + x * 4);
+      store32(d + x * 4, (p & 0xff00ff00) | ((p >> 16) & 0xff) |
+                             ((p & 0xff) << 16));
+    }
+  }
+}
+
+void PixelKernels::fillAlpha(uint8_t* dst,
+                             uint32_t dstStride,
+                             const uint8_t* src,
+                             uint32_t srcStride,
+                             uint32_t width,
+                             uint32_t height) {
+  auto& k = kernels();
+  for (uint32_t y = 0; y < height; y++) {
+    uint8_t* d = dst + y * dstStride;
+    const uint8_t* s = src + y * srcStride;
+    for (uint32_t x = k.alphaRow(d, s, width); x < width; x++) {
+      store32(d + x * 4, load32(s + x * 4) | 0xff000000);
+    }
+  }
+}
+
+void PixelKernels::rgbaToNv12(const uint8_t* src,
+                              uint32_t srcStride,
+                              uint32_t width,
+                              uint32_t height,
+                              uint8_t* y,
+                              uint32_t yStride,
+                              uint8_t* uv,
+                              uint32_t uvStride) {
+  rgbaToYuv(src, srcStride, width, height, y, yStride, uv, uv + 1, uvStride,
+            2);
+}
+
+void PixelKernels::rgbaToI420(const uint8_t* src,
+                              uint32_t srcStride,
+                              uint32_t width,
+                              uint32_t height,
+                              uint8_t* y,
+                              uint32_t yStride,
+                              uint8_t* u,
+                              uint32_t uStride,
+                              uint8_t* v,
+                              uint32_t vStride) {
+  if (uStride != vStride) {
+    ALOGE("%s: u and v strides differ", __func__);
+    return;
+  }
+  rgbaToYuv(src, srcStride, width, height, y, yStride, u, v, uStride, 1);
+}
+
+void PixelKernels::rgbaToYuv(const uint8_t* src,
+                             uint32_t srcStride,
+                             uint32_t width,
+                             uint32_t height,
+                             uint8_t* y,
+                             uint32_t yStride,
+                             uint8_t* u,
+                             uint8_t* v,
+                             uint32_t uvStride,
+                             uint32_t uvStep) {
+  auto& k = kernels();
+  for (uint32_t j = 0; j < height; j++) {
+    const uint8_t* s = src + j * srcStride;
+    uint8_t* d = y + j * yStride;
+    for (uint32_t x = k.lumaRow(d, s, width); x < width; x++) {
+      d[x] = luma(s + x * 4);
+    }
+  }
+
+  // the last odd row and column are averaged with themselves
+  uint32_t chromaW = (width + 1) / 2;
+  uint32_t chromaH = (height + 1) / 2;
+  for (uint32_t j = 0; j < chromaH; j++) {
+    const uint8_t* row0 = src + 2 * j * srcStride;
+    const uint8_t* row1 = 2 * j + 1 < height ? row0 + srcStride : row0;
+    uint8_t* du = u + j * uvStride;
+    uint8_t* dv = v + j * uvStride;
+    // SIMD reads whole pairs of pixels
+    uint32_t i = k.chromaRow(du, dv, uvStep, row0, row1, width / 2);
+    for (; i < chromaW; i++) {
+      uint32_t right = 2 * i + 1 < width ? 4 : 0;
+      chroma(row0 + i * 8, row1 + i * 8, right, du + i * uvStep,
+             dv + i * uvStep);
+    }
+  }
+}
+
+void PixelKernels::fill(uint8_t* dst,
+                        uint32_t dstStride,
+                        uint32_t width,
+                        uint32_t height,
+                        uint32_t color) {
+  auto& k = kernels();
+  for (uint32_t y = 0; y < height; y++) {
+    uint8_t* d = dst + y * dstStride;
+    for (uint32_t x = k.fillRow(d, color, width); x < width; x++) {
+      store32(d + x * 4, color);
+    }
+  }
+}
+
+void PixelKernels::blend(uint8_t* dst,
+                         uint32_t dstStride,
+                         const uint8_t* src,
+                         uint32_t srcStride,
+                         uint32_t width,
+                         uint32_t height,
+                         uint8_t alpha,
+                         bool premultiplied) {
+  auto& k = kernels();
+  for (uint32_t y = 0; y < height; y++) {
+    uint8_t* d = dst + y * dstStride;
+    const uint8_t* s = src + y * srcStride;
+    uint32_t x = k.blendRow(d, s, width, alpha, premultiplied);
+    for (; x < width; x++) {
+      store32(d + x * 4, blendPixel(load32(s + x * 4), load32(d + x * 4),
+                                    alpha, premultiplied));
+    }
+  }
+}
+
+int PixelKernels::rotate(uint8_t* dst,
+                         uint32_t dstStride,
+                         const uint8_t* src,
+                         uint32_t srcStride,
+                         uint32_t width,
+                         uint32_t height,
+                         int degrees) {
+  if (degrees == 0) {
+    copy(dst, dstStride, src, srcStride, width, height);
+    return 0;
+  }
+  if (degrees != 90 && degrees != 180 && degrees != 270) {
+    ALOGE("%s: unsupported rotation %d", __func__, degrees);
+    return -1;
+  }
+
+  uint32_t blocksW = width & ~3u;
+  uint32_t blocksH = height & ~3u;
+  if (!kernels().rotateBlocks(dst, dstStride, src, srcStride, width, height,
+                              blocksW, blocksH, degrees)) {
+    blocksW = 0;
+    blocksH = 0;
+  }
+  // the right and bottom edges the blocks don't cover
+  for (uint32_t y = 0; y < height; y++) {
+    uint32_t x = y < blocksH ? blocksW : 0;
+    for (; x < width; x++) {
+      rotatePixel(dst, dstStride, src, srcStride, width, height, x, y,
+                  degrees);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __PIXEL_KERNELS_H__
+#define __PIXEL_KERNELS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel loops of the copy, dump and composition paths. Each kernel has a scalar version
+// and SSE4/AVX2 ones picked once at runtime from the cpu features, the
+// property hwc_vhal.pixel_isa (scalar, sse4, avx2) caps the choice. All
+// versions give the same result.
+//
+// Pixels are 32 bit RGBA in memory order unless noted, widths and heights
+// are in pixels and strides in bytes.
+class PixelKernels {
+ public:
+  enum Isa {
+    ISA_SCALAR,
+    ISA_SSE4,
+    ISA_AVX2,
+  };
+  static Isa isa();
+  static const char* isaName();
+
+  // Row copy, with non-temporal stores for long rows since the destination
+  // is shared memory that the cpu won't read back.
+  static void copy(uint8_t* dst,
+                   uint32_t dstStride,
+                   const uint8_t* src,
+                   uint32_t srcStride,
+                   uint32_t width,
+                   uint32_t height);
+  // BGRA <-> RGBA, dst may be src
+  static void swizzle(uint8_t* dst,
+                      uint32_t dstStride,
+                      const uint8_t* src,
+                      uint32_t srcStride,
+                      uint32_t width,
+                      uint32_t height);
+  // RGBX -> RGBA with opaque alpha, dst may be src
+  static void fillAlpha(uint8_t* dst,
+                        uint32_t dstStride,
+                        const uint8_t* src,
+                        uint32_t srcStride,
+                        uint32_t width,
+                        uint32_t height);
+  // BT.601 limited range, chroma is the average of each 2x2 block
+  static void rgbaToNv12(const uint8_t* src,
+                         uint32_t srcStride,
+                         uint32_t width,
+                         uint32_t height,
+                         uint8_t* y,
+                         uint32_t yStride,
+                         uint8_t* uv,
+                         uint32_t uvStride);
+  static void rgbaToI420(const uint8_t* src,
+                         uint32_t srcStride,
+                         uint32_t width,
+                         uint32_t height,
+                         uint8_t* y,
+                         uint32_t yStride,
+                         uint8_t* u,
+                         uint32_t uStride,
+                         uint8_t* v,
+                         uint32_t vStride);
+  // every pixel set to color, an RGBA pixel as a little endian word
+  static void fill(uint8_t* dst,
+                   uint32_t dstStride,
+                   uint32_t width,
+                   uint32_t height,
+                   uint32_t color);
+  // Source over blend of src onto dst. alpha is the plane alpha (0-255),
+  // src is either premultiplied or gets its color multiplied by its alpha
+  // (coverage). dst is premultiplied. srcStride 0 repeats the first row.
+  static void blend(uint8_t* dst,
+                    uint32_t dstStride,
+                    const uint8_t* src,
+                    uint32_t srcStride,
+                    uint32_t width,
+                    uint32_t height,
+                    uint8_t alpha,
+                    bool premultiplied);
+  // clockwise by 0, 90, 180 or 270 degrees, width and height are the ones
+  // of src, dst is height x width for 90 and 270
+  static int rotate(uint8_t* dst,
+                    uint32_t dstStride,
+                    const uint8_t* src,
+                    uint32_t srcStride,
+                    uint32_t width,
+                    uint32_t height,
+                    int degrees);
+
+ private:
+  static void rgbaToYuv(const uint8_t* src,
+                        uint32_t srcStride,
+                        uint32_t width,
+                        uint32_t height,
+                        uint8_t* y,
+                        uint32_t yStride,
+                        uint8_t* u,
+                        uint8_t* v,
+                        uint32_t uvStride,
+                        uint32_t uvStep);
+};
+
+#endif  // __PIXEL_KERNELS_H__
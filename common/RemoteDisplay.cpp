@@ -26,15 +26,22 @@ Date: 2021.06.09
 
 //#define LOG_NDEBUG 0
 
+#include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <algorithm>
 
 #include <cutils/properties.h>
 #include <cutils/log.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "RemoteDisplay.h"
 
@@ -47,6 +54,7 @@ Date: 2021.06.09
 
 RemoteDisplay::RemoteDisplay(int fd) : mSocketFd(fd) {}
 RemoteDisplay::~RemoteDisplay() {
+  _closeRecvFds();
   if (mSocketFd >= 0) {
     ALOGD("Close socket %d", mSocketFd);
     close(mSocketFd);
@@ -56,93 +64,344 @@ RemoteDisplay::~RemoteDisplay() {
 int RemoteDisplay::_send(const void* buf, size_t n) {
   ALOGV("RemoteDisplay(%d)::%s size=%zd", mSocketFd, __func__, n);
 
+  struct iovec iov = {const_cast<void*>(buf), buf ? n : 0};
+  return _sendEvent(&iov, 1);
+}
+
+int RemoteDisplay::_sendv(struct iovec* iov,
+                          int iovcnt,
+                          const int* fds,
+                          size_t numFds) {
+  ALOGV("RemoteDisplay(%d)::%s iovcnt=%d fds=%zd", mSocketFd, __func__, iovcnt,
+        numFds);
+
   if (mDisconnected)
     return -1;
 
-  if (!buf || n <= 0)
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (total == 0)
     return 0;
 
-  ssize_t len;
-  len = send(mSocketFd, buf, n, 0);
-  if (len <= 0) {
-    mDisconnected = true;
-    if (mStatusListener) {
-      mStatusListener->onDisconnect(mSocketFd);
-    }
+  if (numFds > kMaxSendFds) {
+    ALOGE("RemoteDisplay(%d) too many fds %zd in one event", mSocketFd,
+          numFds);
     return -1;
   }
+
+  union {
+    char buf[CMSG_SPACE(kMaxSendFds * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  if (fds && numFds > 0) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+    struct cmsghdr* p_cmsg = CMSG_FIRSTHDR(&msg);
+    p_cmsg->cmsg_level = SOL_SOCKET;
+    p_cmsg->cmsg_type = SCM_RIGHTS;
+    p_cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+    memcpy(CMSG_DATA(p_cmsg), fds, numFds * sizeof(int));
+  }
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t len = sendmsg(mSocketFd, &msg, 0);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0) {
+      _disconnect();
+      return -1;
+    }
+    // fds travel with the first byte of the event, never resend them
+    msg.msg_control = nullptr;
+    msg.msg_controllen = 0;
+
+    // short write, skip what has been sent and continue with the rest
+    while (msg.msg_iovlen > 0 && (size_t)len >= msg.msg_iov->iov_len) {
+      len -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + len;
+      msg.msg_iov->iov_len -= len;
+    }
+  }
   return 0;
 }
-int RemoteDisplay::_recv(void* buf, size_t n) {
-  ALOGV("RemoteDisplay(%d)::%s size=%zd", mSocketFd, __func__, n);
+
+int RemoteDisplay::_sendEvent(struct iovec* iov,
+                              int iovcnt,
+                              const int* fds,
+                              size_t numFds) {
+  std::unique_lock<std::mutex> lk(mSendMutex);
+
+  if (!mInFrame)
+    return _transmit(iov, iovcnt, fds, numFds);
 
   if (mDisconnected)
     return -1;
 
-  if (!buf || n <= 0)
-    return 0;
+  if (mBatchFds.size() + numFds > kMaxSendFds) {
+    ALOGE("RemoteDisplay(%d) too many fds in frame batch", mSocketFd);
+    return -1;
+  }
 
-  ssize_t len;
-  len = recv(mSocketFd, buf, n, 0);
-  if (len <= 0) {
-    mDisconnected = true;
-    if (mStatusListener) {
-      mStatusListener->onDisconnect(mSocketFd);
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0)
+      continue;
+    size_t offset = mBatch.size();
+    mBatch.resize(offset + iov[i].iov_len);
+    memcpy(mBatch.data() + offset, iov[i].iov_base, iov[i].iov_len);
+  }
+  if (fds && numFds > 0) {
+    mBatchFds.insert(mBatchFds.end(), fds, fds + numFds);
+  }
+  mBatchEvents++;
+  return 0;
+}
+
+int RemoteDisplay::_transmit(struct iovec* iov,
+                             int iovcnt,
+                             const int* fds,
+                             size_t numFds) {
+  if (!mRing)
+    return _sendv(iov, iovcnt, fds, numFds);
+
+  if (mDisconnected)
+    return -1;
+
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if ((fds && numFds > 0) || total > mRing->dataSize()) {
+    // Fds and events bigger than the ring can only go through the socket.
+    // A marker in the ring tells the consumer where to pick the event up,
+    // so the order is preserved. The marker must not be lost: without it,
+    // every later marker would be paired with the wrong socket event. Its
+    // space is checked before the event is sent.
+    display_event_t sync;
+    memset(&sync, 0, sizeof(sync));
+    sync.type = DD_EVENT_RING_SYNC;
+    sync.size = sizeof(sync);
+    if (mRing->space() < sizeof(sync)) {
+      ALOGE("RemoteDisplay(%d) no ring space for a sync marker", mSocketFd);
+      _disconnect();
+      return -1;
     }
+    if (_sendv(iov, iovcnt, fds, numFds) < 0)
+      return -1;
+
+    struct iovec syncIov = {&sync, sizeof(sync)};
+    return _writeRing(&syncIov, 1);
+  }
+  return _writeRing(iov, iovcnt);
+}
+
+int RemoteDisplay::_writeRing(struct iovec* iov, int iovcnt) {
+  // a dropped event desyncs the stream like a failed send does
+  if (mRing->write(iov, iovcnt) < 0) {
+    _disconnect();
     return -1;
   }
   return 0;
 }
 
-int RemoteDisplay::_sendFds(int* pfd, size_t fdlen) {
+void RemoteDisplay::_disconnect() {
+  mDisconnected = true;
+  if (mStatusListener) {
+    mStatusListener->onDisconnect(mSocketFd);
+  }
+}
+
+int RemoteDisplay::setupRing() {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
-  if (mDisconnected)
+  std::unique_ptr<ShmRing> ring(new ShmRing());
+  if (!ring || ring->create(kRingSize) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to create shm ring", mSocketFd);
     return -1;
+  }
 
-  int count = 0;
-  int i = 0;
-  struct msghdr msg;
-  struct cmsghdr* p_cmsg;
-  struct iovec vec;
-  char cmsgbuf[CMSG_SPACE(fdlen * sizeof(int))];
-  int* p_fds = NULL;
-  int sdata[4] = {
-      0x88,
-  };
+  shm_ring_setup_event_t ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_SHM_RING_SETUP;
+  ev.event.size = sizeof(ev);
+  ev.size = ring->shmSize();
+  ev.dataOffset = ring->dataOffset();
 
-  msg.msg_control = cmsgbuf;
-  msg.msg_controllen = sizeof(cmsgbuf);
-  p_cmsg = CMSG_FIRSTHDR(&msg);
-  p_cmsg->cmsg_level = SOL_SOCKET;
-  p_cmsg->cmsg_type = SCM_RIGHTS;
-  p_cmsg->cmsg_len = CMSG_LEN(fdlen * sizeof(int));
-  p_fds = (int*)CMSG_DATA(p_cmsg);
+  std::unique_lock<std::mutex> lk(mSendMutex);
 
-  for (i = 0; i < (int)fdlen; i++) {
-    p_fds[i] = pfd[i];
+  int fds[2] = {ring->shmFd(), ring->doorbellFd()};
+  struct iovec iov = {&ev, sizeof(ev)};
+  if (_sendv(&iov, 1, fds, 2) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send shm ring setup", mSocketFd);
+    return -1;
   }
+  ALOGI("RemoteDisplay(%d) use shm ring transport, size %u", mSocketFd,
+        kRingSize);
+  mRing = std::move(ring);
+  return 0;
+}
 
-  msg.msg_name = NULL;
-  msg.msg_namelen = 0;
-  msg.msg_iov = &vec;
+int RemoteDisplay::beginFrame(uint32_t frame) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mAckMutex);
+    mFrame = frame;
+  }
+  removeAckedBuffers();
+
+  std::unique_lock<std::mutex> lk(mSendMutex);
+
+  if (!mDisplayFlags.frameBatch || mInFrame)
+    return 0;
+
+  mBatch.resize(sizeof(frame_batch_event_t));
+  mBatchFds.clear();
+  mBatchEvents = 0;
+  mInFrame = true;
+  return 0;
+}
+
+int RemoteDisplay::commitFrame() {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  std::unique_lock<std::mutex> lk(mSendMutex);
+
+  if (!mInFrame)
+    return 0;
+
+  mInFrame = false;
+  if (mBatchEvents == 0)
+    return 0;
+
+  frame_batch_event_t* ev = (frame_batch_event_t*)mBatch.data();
+  memset(ev, 0, sizeof(*ev));
+  ev->event.type = DD_EVENT_FRAME_BATCH;
+  ev->event.size = mBatch.size();
+  ev->numEvents = mBatchEvents;
+  ev->numFds = mBatchFds.size();
+
+  LAYER_TRACE("%s %d events, %zd bytes, %zd fds", __func__, mBatchEvents,
+              mBatch.size(), mBatchFds.size());
+
+  struct iovec iov = {mBatch.data(), mBatch.size()};
+  int ret = _transmit(&iov, 1, mBatchFds.data(), mBatchFds.size());
+  mBatch.clear();
+  mBatchFds.clear();
+  mBatchEvents = 0;
+  if (ret < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send frame batch", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
+void RemoteDisplay::expectAck() {
+  std::unique_lock<std::mutex> lk(mAckMutex);
+  // a remote that doesn't ack must not grow this forever
+  if (mUnacked.size() >= kMaxUnacked) {
+    mUnacked.pop_front();
+  }
+  mUnacked.push_back(mFrame);
+}
+
+uint32_t RemoteDisplay::ackedFrame() {
+  std::unique_lock<std::mutex> lk(mAckMutex);
+  return mUnacked.empty() ? mFrame : mUnacked.front() - 1;
+}
+
+uint32_t RemoteDisplay::takeAck(const display_event_t& ev, bool& advanced) {
+  std::unique_lock<std::mutex> lk(mAckMutex);
+
+  uint32_t acked = mUnacked.empty() ? mFrame : mUnacked.front() - 1;
+  uint32_t frame = ev.id;
+  if (!mDisplayFlags.frameSeq) {
+    frame = mUnacked.empty() ? mFrame : mUnacked.front();
+  }
+  // requests before it were acked or won't be
+  while (!mUnacked.empty() && (int32_t)(mUnacked.front() - frame) < 0) {
+    mUnacked.pop_front();
+  }
+  if (!mUnacked.empty() && mUnacked.front() == frame) {
+    mUnacked.pop_front();
+  }
+  advanced = acked != (mUnacked.empty() ? mFrame : mUnacked.front() - 1);
+  return frame;
+}
+
+int RemoteDisplay::_recv(void* buf, size_t n) {
+  ALOGV("RemoteDisplay(%d)::%s size=%zd", mSocketFd, __func__, n);
+
+  if (mDisconnected)
+    return -1;
+
+  if (!buf || n <= 0)
+    return 0;
+
+  union {
+    char buf[CMSG_SPACE(kMaxSendFds * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {buf, n};
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
   msg.msg_iovlen = 1;
-  msg.msg_flags = 0;
-
-  vec.iov_base = sdata;
-  vec.iov_len = 16;
-  count = sendmsg(mSocketFd, &msg, 0);
-  if (count <= 0) {
-    mDisconnected = true;
-    if (mStatusListener) {
-      mStatusListener->onDisconnect(mSocketFd);
-    }
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t len;
+  do {
+    len = recvmsg(mSocketFd, &msg, MSG_CMSG_CLOEXEC);
+  } while (len < 0 && errno == EINTR);
+  if (len <= 0) {
+    _disconnect();
     return -1;
   }
 
+  for (struct cmsghdr* p_cmsg = CMSG_FIRSTHDR(&msg); p_cmsg;
+       p_cmsg = CMSG_NXTHDR(&msg, p_cmsg)) {
+    if (p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS) {
+      int* fds = (int*)CMSG_DATA(p_cmsg);
+      size_t numFds = (p_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      mRecvFds.insert(mRecvFds.end(), fds, fds + numFds);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    ALOGE("RemoteDisplay(%d) fds received were truncated", mSocketFd);
+  }
   return 0;
 }
 
+int RemoteDisplay::_takeFd(int index) {
+  if (index < 0 || index >= (int)mRecvFds.size())
+    return -1;
+
+  int fd = mRecvFds[index];
+  mRecvFds[index] = -1;
+  return fd;
+}
+
+void RemoteDisplay::_closeRecvFds() {
+  for (auto fd : mRecvFds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  mRecvFds.clear();
+}
+
 int RemoteDisplay::getConfigs() {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
@@ -162,76 +421,231 @@ int RemoteDisplay::getConfigs() {
   return 0;
 }
 
-int RemoteDisplay::createBuffer(buffer_handle_t buffer) {
+// Whether st is the inode shared by all anon inode files, as eventfds and,
+// before Linux 5.3, dma-bufs are.
+static bool isAnonInode(const struct stat& st) {
+  static const std::pair<dev_t, ino_t> anon = []() {
+    std::pair<dev_t, ino_t> id(0, 0);
+    int fd = eventfd(0, EFD_CLOEXEC);
+    if (fd < 0)
+      return id;
+    struct stat est;
+    if (fstat(fd, &est) == 0) {
+      id = std::make_pair(est.st_dev, est.st_ino);
+    }
+    close(fd);
+    return id;
+  }();
+  return anon.second != 0 && st.st_dev == anon.first &&
+         st.st_ino == anon.second;
+}
+
+// static
+int RemoteDisplay::getBufferKey(buffer_handle_t buffer, BufferKey& key) {
+  if (!buffer)
+    return -1;
+
+  if (buffer->numFds <= 0) {
+    // nothing better than the handle itself
+    key = BufferKey(0, (uint64_t)buffer);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(buffer->data[0], &st) < 0) {
+    ALOGE("Failed to stat buffer %p fd %d:%s", buffer, buffer->data[0],
+          strerror(errno));
+    return -1;
+  }
+  if (isAnonInode(st)) {
+    // every dma-buf has this inode, it tells nothing apart
+    key = BufferKey(0, (uint64_t)buffer);
+    return 0;
+  }
+  key = BufferKey((uint64_t)st.st_dev, (uint64_t)st.st_ino);
+  return 0;
+}
+
+uint64_t RemoteDisplay::acquireBuffer(buffer_handle_t buffer,
+                                      const BufferKey& key) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  auto it = mBuffers.find(key);
+  if (it != mBuffers.end()) {
+    it->second.refs++;
+    return it->second.id;
+  }
+
+  uint64_t id = mNextBufferId++;
+  if (createBuffer(buffer, id) < 0) {
+    return 0;
+  }
+  mBuffers[key] = {id, 1};
+  return id;
+}
+
+void RemoteDisplay::releaseBuffer(const BufferKey& key) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  auto it = mBuffers.find(key);
+  if (it == mBuffers.end())
+    return;
+
+  if (--it->second.refs == 0) {
+    uint64_t id = it->second.id;
+    mBuffers.erase(it);
+
+    // the remote may still be showing it
+    auto sent = mBufferFrames.find(id);
+    if (sent != mBufferFrames.end()) {
+      uint32_t frame = sent->second;
+      mBufferFrames.erase(sent);
+      if ((int32_t)(frame - ackedFrame()) > 0) {
+        mRetiredBuffers.emplace_back(id, frame);
+        return;
+      }
+    }
+    removeBuffer(id);
+  }
+}
+
+void RemoteDisplay::removeAckedBuffers() {
+  if (mRetiredBuffers.empty())
+    return;
+
+  uint32_t acked = ackedFrame();
+  auto it = mRetiredBuffers.begin();
+  while (it != mRetiredBuffers.end()) {
+    if ((int32_t)(it->second - acked) <= 0) {
+      removeBuffer(it->first);
+      it = mRetiredBuffers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+int RemoteDisplay::createBuffer(buffer_handle_t buffer, uint64_t bufferId) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
   buffer_info_event_t ev;
+  size_t handleSize = sizeof(native_handle_t) +
+                      (buffer->numFds + buffer->numInts) * sizeof(int);
+  // legacy trailer that used to carry the fds, kept for wire compatibility
+  // outside of frame batches
+  int sdata[4] = {
+      0x88,
+  };
 
   memset(&ev, 0, sizeof(ev));
   ev.event.type = DD_EVENT_CREATE_BUFFER;
-  ev.info.bufferId = (int64_t)buffer;
-  ev.event.size = sizeof(ev) + sizeof(native_handle_t) +
-                  (buffer->numFds + buffer->numInts) * 4;
+  ev.info.bufferId = bufferId;
+  ev.event.size = sizeof(ev) + handleSize;
 
-  if (_send(&(ev.event), sizeof(ev.event)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
-    return -1;
-  }
-  if (_send(&(ev.info), sizeof(ev.info)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send create buffer event info",
-          mSocketFd);
-    return -1;
-  }
-  if (_send(buffer, sizeof(native_handle_t) +
-                        (buffer->numFds + buffer->numInts) * 4) < 0) {
+  struct iovec iov[3] = {
+      {&ev, sizeof(ev)},
+      {const_cast<native_handle_t*>(buffer), handleSize},
+      {sdata, (buffer->numFds > 0 && !mInFrame) ? sizeof(sdata) : 0},
+  };
+  if (_sendEvent(iov, 3, buffer->data, buffer->numFds) < 0) {
     ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
     return -1;
   }
-  if (buffer->numFds > 0) {
-    if (_sendFds((int*)(buffer->data), buffer->numFds) < 0) {
-      ALOGE("RemoteDisplay(%d) failed to send create buffer event", mSocketFd);
-      return -1;
-    }
-  }
   return 0;
 }
 
-int RemoteDisplay::removeBuffer(buffer_handle_t buffer) {
+int RemoteDisplay::removeBuffer(uint64_t bufferId) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
   buffer_info_event_t ev;
 
   memset(&ev, 0, sizeof(ev));
   ev.event.type = DD_EVENT_REMOVE_BUFFER;
-  ev.info.bufferId = (int64_t)buffer;
+  ev.info.bufferId = bufferId;
   ev.event.size = sizeof(ev);
 
-  if (_send(&(ev.event), sizeof(ev.event)) < 0) {
+  if (_send(&ev, sizeof(ev)) < 0) {
     ALOGE("RemoteDisplay(%d) failed to send remove buffer event", mSocketFd);
     return -1;
   }
-  if (_send(&(ev.info), sizeof(ev.info)) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send remove buffer event info",
-          mSocketFd);
-    return -1;
-  }
   return 0;
 }
 
-int RemoteDisplay::displayBuffer(buffer_handle_t buffer) {
+// static
+void RemoteDisplay::getDamage(const hwc_region_t& region, Damage& damage) {
+  damage.clear();
+  if (region.numRects == 0 || !region.rects)
+    return;
+
+  if (region.numRects <= DAMAGE_MAX_RECTS) {
+    for (size_t i = 0; i < region.numRects; i++) {
+      const hwc_rect_t& r = region.rects[i];
+      damage.push_back({r.left, r.top, r.right, r.bottom});
+    }
+    return;
+  }
+
+  // stays empty, i.e. nothing damaged, if every rect is
+  rect_t box = {0, 0, 0, 0};
+  bool empty = true;
+  for (size_t i = 0; i < region.numRects; i++) {
+    const hwc_rect_t& r = region.rects[i];
+    if (r.right <= r.left || r.bottom <= r.top)
+      continue;
+    if (empty) {
+      box = {r.left, r.top, r.right, r.bottom};
+      empty = false;
+      continue;
+    }
+    box.left = std::min(box.left, r.left);
+    box.top = std::min(box.top, r.top);
+    box.right = std::max(box.right, r.right);
+    box.bottom = std::max(box.bottom, r.bottom);
+  }
+  damage.push_back(box);
+}
+
+void RemoteDisplay::packDamage(const Damage* damage) {
+  damage_region_t region;
+  memset(&region, 0, sizeof(region));
+  region.numRects = damage ? damage->size() : 0;
+
+  size_t offset = mDamageBuf.size();
+  mDamageBuf.resize(offset + sizeof(region) +
+                    sizeof(rect_t) * region.numRects);
+  memcpy(mDamageBuf.data() + offset, &region, sizeof(region));
+  if (region.numRects) {
+    memcpy(mDamageBuf.data() + offset + sizeof(region), damage->data(),
+           sizeof(rect_t) * region.numRects);
+  }
+}
+
+int RemoteDisplay::displayBuffer(uint64_t bufferId, const Damage* damage) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
   buffer_info_event_t ev;
 
+  mDamageBuf.clear();
+  if (mDisplayFlags.damage) {
+    packDamage(damage);
+  }
+
   memset(&ev, 0, sizeof(ev));
   ev.event.type = DD_EVENT_DISPLAY_REQ;
-  ev.event.size = sizeof(ev);
-  ev.info.bufferId = (int64_t)buffer;
+  ev.event.size = sizeof(ev) + mDamageBuf.size();
+  ev.event.id = mFrame;
+  ev.info.bufferId = bufferId;
 
-  if (_send(&ev, sizeof(ev)) < 0) {
+  struct iovec iov[2] = {
+      {&ev, sizeof(ev)},
+      {mDamageBuf.data(), mDamageBuf.size()},
+  };
+  if (_sendEvent(iov, 2) < 0) {
     ALOGE("RemoteDisplay(%d) failed to send display buffer request", mSocketFd);
     return -1;
   }
+  mBufferFrames[bufferId] = mFrame;
+  expectAck();
   return 0;
 }
 
@@ -252,6 +666,67 @@ int RemoteDisplay::setRotation(int rotation) {
   return 0;
 }
 
+int RemoteDisplay::setVsyncEnabled(bool enabled) {
+  ALOGV("RemoteDisplay(%d)::%s:enabled=%d", mSocketFd, __func__, enabled);
+
+  if (!mDisplayFlags.remoteVsync)
+    return 0;
+
+  set_vsync_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_SET_VSYNC;
+  ev.event.size = sizeof(ev);
+  ev.enabled = enabled ? 1 : 0;
+
+  if (_send(&ev, sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send set vsync request", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
+int RemoteDisplay::setConfig(uint32_t config) {
+  ALOGV("RemoteDisplay(%d)::%s:config=%u", mSocketFd, __func__, config);
+
+  if (config >= mConfigs.size())
+    return -1;
+
+  set_config_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_SET_CONFIG;
+  ev.event.size = sizeof(ev);
+  ev.config = config;
+
+  if (_send(&ev, sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send set config request", mSocketFd);
+    return -1;
+  }
+  mActiveConfig = config;
+  return 0;
+}
+
+int RemoteDisplay::setIdle(bool idle) {
+  ALOGV("RemoteDisplay(%d)::%s:idle=%d", mSocketFd, __func__, idle);
+
+  if (!mDisplayFlags.idleHint)
+    return 0;
+
+  set_idle_event_t ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_SET_IDLE;
+  ev.event.size = sizeof(ev);
+  ev.idle = idle ? 1 : 0;
+
+  if (_send(&ev, sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send idle hint", mSocketFd);
+    return -1;
+  }
+  return 0;
+}
+
 int RemoteDisplay::createLayer(uint64_t id) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
@@ -291,97 +766,160 @@ int RemoteDisplay::removeLayer(uint64_t id) {
 int RemoteDisplay::updateLayers(std::vector<layer_info_t>& layerInfo) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
+  if (mDisplayFlags.layerDelta) {
+    return updateLayersDelta(layerInfo);
+  }
+
   update_layers_event_t ev;
-  uint32_t numLayers = 0;
-  layer_info_t* layers = nullptr;
-
-  numLayers = layerInfo.size();
-  if (numLayers) {
-    layers = (layer_info_t*)malloc(sizeof(layer_info_t) * numLayers);
-    if (!layers) {
-      ALOGE("Failed to alloc layer info, out of memory");
-      return -1;
-    }
-    LAYER_TRACE("%s layer count %d", __func__, numLayers);
-    for (uint32_t i = 0; i < numLayers; i++) {
-      layers[i] = layerInfo[i];
-      LAYER_TRACE("  %d layer %" PRIx64 " stack %d task %d", i,
-                  layers[i].layerId, layers[i].stackId, layers[i].taskId);
-    }
+  uint32_t numLayers = layerInfo.size();
+
+  LAYER_TRACE("%s layer count %d", __func__, numLayers);
+  for (uint32_t i = 0; i < numLayers; i++) {
+    LAYER_TRACE("  %d layer %" PRIx64 " stack %d task %d", i,
+                layerInfo[i].layerId, layerInfo[i].stackId,
+                layerInfo[i].taskId);
   }
 
+  memset(&ev, 0, sizeof(ev));
   ev.event.type = DD_EVENT_UPDATE_LAYERS;
   ev.event.size = sizeof(ev) + sizeof(layer_info_t) * numLayers;
   ev.numLayers = numLayers;
 
-  if (_send(&(ev), sizeof(ev)) < 0) {
+  struct iovec iov[2] = {
+      {&ev, sizeof(ev)},
+      {layerInfo.data(), sizeof(layer_info_t) * numLayers},
+  };
+  if (_sendEvent(iov, 2) < 0) {
     ALOGE("RemoteDisplay(%d) failed to send update layers event", mSocketFd);
-    if (layers) {
-      free(layers);
-    }
     return -1;
   }
+  return 0;
+}
+
+static const struct {
+  uint32_t field;
+  size_t offset;
+  size_t size;
+} kLayerFields[] = {
+    {LAYER_FIELD_TYPE, offsetof(layer_info_t, type), sizeof(uint32_t)},
+    {LAYER_FIELD_TASK_INFO, offsetof(layer_info_t, stackId),
+     sizeof(uint32_t) * 4},
+    {LAYER_FIELD_SRC_CROP, offsetof(layer_info_t, srcCrop), sizeof(rect_t)},
+    {LAYER_FIELD_DST_FRAME, offsetof(layer_info_t, dstFrame), sizeof(rect_t)},
+    {LAYER_FIELD_TRANSFORM, offsetof(layer_info_t, transform),
+     sizeof(uint32_t)},
+    {LAYER_FIELD_Z, offsetof(layer_info_t, z), sizeof(uint32_t)},
+    {LAYER_FIELD_BLEND_MODE, offsetof(layer_info_t, blendMode),
+     sizeof(int32_t)},
+    {LAYER_FIELD_PLANE_ALPHA, offsetof(layer_info_t, planeAlpha),
+     sizeof(float)},
+    {LAYER_FIELD_COLOR, offsetof(layer_info_t, color), sizeof(uint32_t)},
+};
+
+int RemoteDisplay::updateLayersDelta(std::vector<layer_info_t>& layerInfo) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  update_layers_delta_event_t ev;
+  uint32_t numLayers = layerInfo.size();
+  size_t worst = (sizeof(layer_delta_t) + sizeof(layer_info_t)) * numLayers;
 
-  if (_send(layers, sizeof(layer_info_t) * numLayers) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send update layers info", mSocketFd);
-    if (layers) {
-      free(layers);
+  if (mDeltaBuf.size() < worst) {
+    mDeltaBuf.resize(worst);
+  }
+
+  uint8_t* p = mDeltaBuf.data();
+  for (auto& info : layerInfo) {
+    layer_delta_t rec;
+    uint8_t* fields = p + sizeof(rec);
+    uint8_t* q = fields;
+    const uint8_t* src = (const uint8_t*)&info;
+
+    for (auto& f : kLayerFields) {
+      if (info.changed & f.field) {
+        memcpy(q, src + f.offset, f.size);
+        q += f.size;
+      }
     }
-    return -1;
+    rec.layerId = info.layerId;
+    rec.dirty = info.changed & LAYER_FIELD_ALL;
+    rec.size = q - fields;
+    memcpy(p, &rec, sizeof(rec));
+    p = q;
+
+    LAYER_TRACE("  layer %" PRIx64 " dirty %x size %d", rec.layerId,
+                rec.dirty, rec.size);
   }
 
-  if (layers) {
-    free(layers);
+  memset(&ev, 0, sizeof(ev));
+  ev.event.type = DD_EVENT_UPDATE_LAYERS_DELTA;
+  ev.event.size = sizeof(ev) + (p - mDeltaBuf.data());
+  ev.version = LAYER_DELTA_VERSION;
+  ev.numLayers = numLayers;
+
+  struct iovec iov[2] = {
+      {&ev, sizeof(ev)},
+      {mDeltaBuf.data(), (size_t)(p - mDeltaBuf.data())},
+  };
+  if (_sendEvent(iov, 2) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to send update layers delta event",
+          mSocketFd);
+    return -1;
   }
   return 0;
 }
 
 int RemoteDisplay::presentLayers(
-    std::vector<layer_buffer_info_t>& layerBuffer) {
+    std::vector<layer_buffer_info_t>& layerBuffer,
+    const std::vector<const Damage*>& damage) {
   ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
 
   present_layers_req_event_t ev;
-  uint32_t numLayers = 0;
-  layer_buffer_info_t* layers = nullptr;
-
-  numLayers = layerBuffer.size();
-  if (numLayers) {
-    layers =
-        (layer_buffer_info_t*)malloc(sizeof(layer_buffer_info_t) * numLayers);
-    if (!layers) {
-      ALOGE("Failed to alloc present req layer buffer info, out of memory");
-      return -1;
+  uint32_t numLayers = layerBuffer.size();
+  int fds[kMaxSendFds];
+  size_t numFds = 0;
+
+  for (auto& lb : layerBuffer) {
+    if (lb.fence < 0 || !mDisplayFlags.fences) {
+      lb.fence = -1;
+    } else if (numFds < kMaxSendFds) {
+      fds[numFds] = lb.fence;
+      lb.fence = numFds++;
+    } else {
+      ALOGW("RemoteDisplay(%d) too many acquire fences, layer %" PRIx64
+            " is sent without",
+            mSocketFd, lb.layerId);
+      lb.fence = -1;
     }
+  }
+
+  mDamageBuf.clear();
+  if (mDisplayFlags.damage) {
     for (uint32_t i = 0; i < numLayers; i++) {
-      layers[i] = layerBuffer[i];
+      packDamage(i < damage.size() ? damage.at(i) : nullptr);
     }
   }
 
+  memset(&ev, 0, sizeof(ev));
   ev.event.type = DD_EVENT_PRESENT_LAYERS_REQ;
-  ev.event.size = sizeof(ev) + sizeof(layer_buffer_info_t) * numLayers;
+  ev.event.size = sizeof(ev) + sizeof(layer_buffer_info_t) * numLayers +
+                  mDamageBuf.size();
+  ev.event.id = mFrame;
   ev.numLayers = numLayers;
 
-  if (_send(&(ev), sizeof(ev)) < 0) {
+  struct iovec iov[3] = {
+      {&ev, sizeof(ev)},
+      {layerBuffer.data(), sizeof(layer_buffer_info_t) * numLayers},
+      {mDamageBuf.data(), mDamageBuf.size()},
+  };
+  if (_sendEvent(iov, 3, fds, numFds) < 0) {
     ALOGE("RemoteDisplay(%d) failed to send present layers req event",
           mSocketFd);
-    if (layers) {
-      free(layers);
-    }
-    return -1;
-  }
-
-  if (_send(layers, sizeof(layer_buffer_info_t) * numLayers) < 0) {
-    ALOGE("RemoteDisplay(%d) failed to send present layers info", mSocketFd);
-    if (layers) {
-      free(layers);
-    }
     return -1;
   }
-  // TODO: send layers' acqureFences
-  if (layers) {
-    free(layers);
+  for (auto& lb : layerBuffer) {
+    mBufferFrames[lb.bufferId] = mFrame;
   }
-
+  expectAck();
   return 0;
 }
 
@@ -401,6 +939,38 @@ int RemoteDisplay::onDisplayInfoAck(const display_event_t& ev) {
   mYDpi = info.ydpi;
   mDisplayFlags.value = info.flags;
 
+  mConfigs.clear();
+  mActiveConfig = 0;
+  if (mDisplayFlags.multiConfig) {
+    display_config_list_t list;
+    if (_recv(&list, sizeof(list)) < 0) {
+      ALOGE("RemoteDisplay(%d) failed to receive config list", mSocketFd);
+      return -1;
+    }
+    for (uint32_t i = 0; i < list.numConfigs; i++) {
+      display_config_t config;
+      if (_recv(&config, sizeof(config)) < 0) {
+        ALOGE("RemoteDisplay(%d) failed to receive config %u", mSocketFd, i);
+        return -1;
+      }
+      if (mConfigs.size() < DISPLAY_MAX_CONFIGS && config.width &&
+          config.height && config.fps > 0) {
+        mConfigs.push_back(config);
+      } else {
+        ALOGW("RemoteDisplay(%d) ignore config %u <%ux%u@%.1f>", mSocketFd, i,
+              config.width, config.height, config.fps);
+      }
+    }
+    if (list.activeConfig < mConfigs.size()) {
+      mActiveConfig = list.activeConfig;
+    }
+  }
+
+  if (mDisplayFlags.shmRing && !mRing) {
+    // the socket still works if the ring can't be set up
+    setupRing();
+  }
+
   if (mStatusListener) {
     mStatusListener->onConnect(mSocketFd);
   }
@@ -416,8 +986,13 @@ int RemoteDisplay::onDisplayBufferAck(const display_event_t& ev) {
     ALOGE("RemoteDisplay(%d) failed to receive present ack", mSocketFd);
     return -1;
   }
+  bool advanced = false;
+  uint32_t frame = takeAck(ev, advanced);
   if (mEventListener) {
-    mEventListener->onBufferDisplayed(info);
+    mEventListener->onBufferDisplayed(frame, info);
+    if (advanced) {
+      mEventListener->onFramesAcked(ackedFrame());
+    }
   }
   return 0;
 }
@@ -442,10 +1017,65 @@ int RemoteDisplay::onPresentLayersAck(const display_event_t& ev) {
       return -1;
     }
   }
+
+  // fences are sent as indexes of the fds attached to the ack
+  if (mDisplayFlags.fences) {
+    ack.releaseFence = _takeFd(ack.releaseFence);
+    for (auto& lb : layerBuffers) {
+      lb.fence = _takeFd(lb.fence);
+    }
+  } else {
+    ack.releaseFence = -1;
+    for (auto& lb : layerBuffers) {
+      lb.fence = -1;
+    }
+  }
+
+  bool advanced = false;
+  uint32_t frame = takeAck(ev, advanced);
   if (mEventListener) {
-    mEventListener->onPresented(layerBuffers, ack.releaseFence);
+    mEventListener->onPresented(frame, layerBuffers, ack.releaseFence);
+    if (advanced) {
+      mEventListener->onFramesAcked(ackedFrame());
+    }
+  } else {
+    if (ack.releaseFence >= 0) {
+      close(ack.releaseFence);
+    }
+    for (auto& lb : layerBuffers) {
+      if (lb.fence >= 0) {
+        close(lb.fence);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int RemoteDisplay::onVsync(const display_event_t& ev) {
+  ALOGV("RemoteDisplay(%d)::%s", mSocketFd, __func__);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t arrival = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+  vsync_event_t vsync;
+  if (_recv(&vsync.timestamp, sizeof(vsync) - sizeof(ev)) < 0) {
+    ALOGE("RemoteDisplay(%d) failed to receive vsync event", mSocketFd);
+    return -1;
+  }
+
+  // a remote timestamp from the future or older than one second is not on
+  // our clock
+  int64_t timestamp = vsync.timestamp;
+  if (timestamp <= 0 || timestamp > arrival ||
+      arrival - timestamp > 1000000000LL) {
+    timestamp = arrival;
   }
 
+  if (mEventListener) {
+    mEventListener->onVsync(timestamp, vsync.period);
+  }
   return 0;
 }
 
@@ -468,6 +1098,9 @@ int RemoteDisplay::onDisplayEvent() {
     case DD_EVENT_PRESENT_LAYERS_ACK:
       onPresentLayersAck(ev);
       break;
+    case DD_EVENT_VSYNC:
+      onVsync(ev);
+      break;
     default: {
       char buf[1024];
       ret = _recv(buf, 1024);
@@ -476,6 +1109,58 @@ int RemoteDisplay::onDisplayEvent() {
       break;
     }
   }
+  // drop whatever fd the handler didn't take
+  _closeRecvFds();
 
   return 0;
 }
+
+void RemoteBufferSet::setRemoteDisplay(RemoteDisplay* rd) {
+  if (rd != mRemoteDisplay) {
+    mBuffers.clear();
+    mRemoteDisplay = rd;
+  }
+}
+
+uint64_t RemoteBufferSet::use(buffer_handle_t buffer) {
+  if (!mRemoteDisplay || !buffer)
+    return 0;
+
+  // the handle pointer may be a freed one reused for another buffer
+  RemoteDisplay::BufferKey key;
+  if (RemoteDisplay::getBufferKey(buffer, key) < 0)
+    return 0;
+
+  for (size_t i = 0; i < mBuffers.size(); i++) {
+    if (mBuffers[i].key == key) {
+      return moveToFront(i);
+    }
+  }
+
+  uint64_t id = mRemoteDisplay->acquireBuffer(buffer, key);
+  if (id == 0)
+    return 0;
+
+  if (mBuffers.size() >= mMaxBuffers) {
+    mRemoteDisplay->releaseBuffer(mBuffers.back().key);
+    mBuffers.pop_back();
+  }
+  mBuffers.insert(mBuffers.begin(), Entry{key, id});
+  return id;
+}
+
+uint64_t RemoteBufferSet::moveToFront(size_t index) {
+  Entry entry = mBuffers[index];
+  mBuffers.erase(mBuffers.begin() + index);
+  mBuffers.insert(mBuffers.begin(), entry);
+  return entry.id;
+}
+
+void RemoteBufferSet::clear() {
+  if (mRemoteDisplay) {
+    for (auto& b : mBuffers) {
+      mRemoteDisplay->releaseBuffer(b.key);
+    }
+  }
+  mBuffers.clear();
+}
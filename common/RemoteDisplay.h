@@ -26,10 +26,17 @@ Date: 2021.06.09
 #define __REMOTE_DISPLAY_H__
 
 #include <hardware/hwcomposer2.h>
+#include <sys/uio.h>
 
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 
 #include "IRemoteDevice.h"
+#include "ShmRing.h"
 #include "display_protocol.h"
 
 class RemoteDisplay {
@@ -44,6 +51,11 @@ class RemoteDisplay {
   int ydpi() const { return mYDpi; }
   uint32_t flags() const { return mDisplayFlags.value; }
   bool primaryHotplug() const { return mDisplayFlags.primaryHotplug; }
+  bool idleHint() const { return mDisplayFlags.idleHint; }
+  uint32_t maxPlanes() const { return mDisplayFlags.maxPlanes; }
+  // modes advertised by the remote, empty if it has only the one above
+  const std::vector<display_config_t>& configs() const { return mConfigs; }
+  uint32_t activeConfig() const { return mActiveConfig; }
 
   uint64_t getDisplayId() const { return mDisplayId; }
   void setDisplayId(uint64_t id) { mDisplayId = id; }
@@ -57,27 +69,85 @@ class RemoteDisplay {
     return 0;
   }
 
+  // Batch all requests of one frame into a single DD_EVENT_FRAME_BATCH if
+  // the remote supports it. frame numbers the requests, acks are matched
+  // to it.
+  int beginFrame(uint32_t frame);
+  int commitFrame();
+  // all frames up to this one have been acked
+  uint32_t ackedFrame();
+
+  // Buffer registry. A gralloc buffer is identified by the inode backing its
+  // first fd rather than by the handle pointer, which is reused after free
+  // and differs between layers importing the same buffer. Before Linux 5.3
+  // all dma-bufs share one anon inode, the handle pointer is the key there
+  // and such kernels get the reuse hazard back. The handle is sent
+  // to the remote once, when the first user acquires it, and removed when the
+  // last one releases it, as soon as the frames it was sent with are acked.
+  // Ids returned are the ids used in the protocol.
+  typedef std::pair<uint64_t, uint64_t> BufferKey;
+  static int getBufferKey(buffer_handle_t buffer, BufferKey& key);
+  uint64_t acquireBuffer(buffer_handle_t buffer, const BufferKey& key);
+  void releaseBuffer(const BufferKey& key);
+
+  // Damage regions as sent in the protocol: no rect is the whole buffer.
+  // Regions with more rects than the protocol takes are reduced to their
+  // bounding box.
+  typedef std::vector<rect_t> Damage;
+  static void getDamage(const hwc_region_t& region, Damage& damage);
+
   // requests sent to remote
   int getConfigs();
-  int createBuffer(buffer_handle_t buffer);
-  int removeBuffer(buffer_handle_t buffer);
-  int displayBuffer(buffer_handle_t buffer);
+  int displayBuffer(uint64_t bufferId, const Damage* damage = nullptr);
   int setRotation(int rotation);
+  // no-op if the remote doesn't send vsync
+  int setVsyncEnabled(bool enabled);
+  // index in configs()
+  int setConfig(uint32_t config);
+  // no-op if the remote doesn't take idle hints
+  int setIdle(bool idle);
   int createLayer(uint64_t id);
   int removeLayer(uint64_t id);
   int updateLayers(std::vector<layer_info_t>& layerInfo);
-  int presentLayers(std::vector<layer_buffer_info_t>& layerBuffer);
+  // the fence of each layer is rewritten to its index in the fds sent,
+  // damage is empty or has one region per layer
+  int presentLayers(std::vector<layer_buffer_info_t>& layerBuffer,
+                    const std::vector<const Damage*>& damage =
+                        std::vector<const Damage*>());
 
   // events from remote
   int onDisplayEvent();
 
  private:
+  // Every event is framed as an iovec list over the caller's storage and
+  // written with a single sendmsg, fds are attached as SCM_RIGHTS.
+  static const size_t kMaxSendFds = 64;
+  static const uint32_t kRingSize = 256 * 1024;
+
   int _send(const void* buf, size_t n);
+  int _sendv(struct iovec* iov, int iovcnt,
+             const int* fds = nullptr, size_t numFds = 0);
+  int _sendEvent(struct iovec* iov, int iovcnt,
+                 const int* fds = nullptr, size_t numFds = 0);
+  int _transmit(struct iovec* iov, int iovcnt,
+                const int* fds = nullptr, size_t numFds = 0);
+  int setupRing();
+  int _writeRing(struct iovec* iov, int iovcnt);
+  void _disconnect();
+  int updateLayersDelta(std::vector<layer_info_t>& layerInfo);
+  void packDamage(const Damage* damage);
+  int createBuffer(buffer_handle_t buffer, uint64_t bufferId);
+  int removeBuffer(uint64_t bufferId);
+  void removeAckedBuffers();
   int _recv(void* buf, size_t n);
-  int _sendFds(int* pfd, size_t fdlen);
+  int _takeFd(int index);
+  void _closeRecvFds();
   int onDisplayInfoAck(const display_event_t& ev);
   int onDisplayBufferAck(const display_event_t& ev);
   int onPresentLayersAck(const display_event_t& ev);
+  int onVsync(const display_event_t& ev);
+  void expectAck();
+  uint32_t takeAck(const display_event_t& ev, bool& advanced);
 
  private:
   bool mDisconnected = false;
@@ -89,10 +159,76 @@ class RemoteDisplay {
   uint32_t mWidth;
   uint32_t mHeight;
   uint32_t mFramerate;
+  std::vector<display_config_t> mConfigs;
+  uint32_t mActiveConfig = 0;
   uint32_t mXDpi;
   uint32_t mYDpi;
 
   display_flags mDisplayFlags = {.value = 0};
+
+  // per-frame command buffer, capacity is kept across frames
+  bool mInFrame = false;
+  // sends come from the hwc, the idle timer and the event thread
+  std::mutex mSendMutex;
+  uint32_t mBatchEvents = 0;
+  std::vector<uint8_t> mBatch;
+  std::vector<int> mBatchFds;
+  std::vector<uint8_t> mDeltaBuf;
+  std::vector<uint8_t> mDamageBuf;
+
+  // frames of the requests not acked yet, in order
+  static const size_t kMaxUnacked = 64;
+  std::mutex mAckMutex;
+  uint32_t mFrame = 0;
+  std::deque<uint32_t> mUnacked;
+
+  // fds received with the event being handled
+  std::vector<int> mRecvFds;
+
+  // shared memory transport, once set up all fd-less events go through it
+  std::unique_ptr<ShmRing> mRing;
+
+  struct RemoteBuffer {
+    uint64_t id;
+    uint32_t refs;
+  };
+  std::map<BufferKey, RemoteBuffer> mBuffers;
+  uint64_t mNextBufferId = 1;
+  // frame each buffer was last sent with, and released buffers waiting for
+  // that frame's ack before they are removed
+  std::map<uint64_t, uint32_t> mBufferFrames;
+  std::vector<std::pair<uint64_t, uint32_t>> mRetiredBuffers;
+};
+
+// Buffers used by one client of a RemoteDisplay (a layer, the client target),
+// holding one registry reference each. At most maxBuffers are kept, the least
+// recently used one is released when a new buffer comes in.
+class RemoteBufferSet {
+ public:
+  RemoteBufferSet(size_t maxBuffers) : mMaxBuffers(maxBuffers) {}
+  ~RemoteBufferSet() { clear(); }
+
+  // switching display drops the references without notifying the old remote
+  void setRemoteDisplay(RemoteDisplay* rd);
+  // returns the remote id of the buffer, 0 if it can't be used
+  uint64_t use(buffer_handle_t buffer);
+  void clear();
+
+ private:
+  RemoteBufferSet(const RemoteBufferSet&) = delete;
+  RemoteBufferSet& operator=(const RemoteBufferSet&) = delete;
+
+  uint64_t moveToFront(size_t index);
+
+  struct Entry {
+    RemoteDisplay::BufferKey key;
+    uint64_t id;
+  };
+
+  RemoteDisplay* mRemoteDisplay = nullptr;
+  size_t mMaxBuffers;
+  // most recently used first
+  std::vector<Entry> mBuffers;
 };
 
 #endif  // __REMOTE_DISPLAY_H__
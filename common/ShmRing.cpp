@@ -0,0 +1,158 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ShmRing.h"
+
+ShmRing::ShmRing() {}
+
+ShmRing::~ShmRing() {
+  if (mHeader) {
+    munmap(mHeader, mShmSize);
+  }
+  if (mShmFd >= 0) {
+    close(mShmFd);
+  }
+  if (mDoorbellFd >= 0) {
+    close(mDoorbellFd);
+  }
+}
+
+int ShmRing::create(uint32_t dataSize) {
+  ALOGV("ShmRing::%s size=%u", __func__, dataSize);
+
+  if (dataSize == 0 || (dataSize & (dataSize - 1)) != 0) {
+    ALOGE("Ring size %u is not a power of 2", dataSize);
+    return -1;
+  }
+
+  // bionic only has the memfd_create wrapper since R
+  mShmFd = syscall(__NR_memfd_create, "hwc-ring",
+                   MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (mShmFd < 0) {
+    ALOGE("Failed to create ring memfd:%s", strerror(errno));
+    return -1;
+  }
+  mShmSize = sizeof(shm_ring_header_t) + dataSize;
+  if (ftruncate(mShmFd, mShmSize) < 0) {
+    ALOGE("Failed to resize ring memfd:%s", strerror(errno));
+    return -1;
+  }
+  // the remote must not be able to shrink it under us
+  fcntl(mShmFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+  void* addr =
+      mmap(nullptr, mShmSize, PROT_READ | PROT_WRITE, MAP_SHARED, mShmFd, 0);
+  if (addr == MAP_FAILED) {
+    ALOGE("Failed to map ring memfd:%s", strerror(errno));
+    return -1;
+  }
+  mHeader = (shm_ring_header_t*)addr;
+  mData = (uint8_t*)addr + sizeof(shm_ring_header_t);
+  mDataSize = dataSize;
+
+  mDoorbellFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (mDoorbellFd < 0) {
+    ALOGE("Failed to create ring doorbell:%s", strerror(errno));
+    return -1;
+  }
+
+  memset(mHeader, 0, sizeof(shm_ring_header_t));
+  mHeader->magic = SHM_RING_MAGIC;
+  mHeader->size = mDataSize;
+  return 0;
+}
+
+void ShmRing::kick() {
+  uint64_t one = 1;
+  if (::write(mDoorbellFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    ALOGE("Failed to kick ring doorbell:%s", strerror(errno));
+  }
+}
+
+size_t ShmRing::space() const {
+  if (!mHeader)
+    return 0;
+  uint64_t tail = __atomic_load_n(&mHeader->tail, __ATOMIC_ACQUIRE);
+  return mDataSize - (mHeader->head - tail);
+}
+
+int ShmRing::write(const struct iovec* iov, int iovcnt) {
+  if (!mHeader)
+    return -1;
+
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  if (len > mDataSize) {
+    ALOGE("Event of %zd bytes doesn't fit the ring", len);
+    return -1;
+  }
+
+  // The consumer fell behind by a whole ring. Waiting here would stall the
+  // present thread as well, the caller drops the connection instead.
+  if (space() < len) {
+    ALOGE("Ring is full, consumer stalled at %" PRIu64,
+          __atomic_load_n(&mHeader->tail, __ATOMIC_ACQUIRE));
+    kick();
+    return -1;
+  }
+
+  // only this side writes head
+  uint64_t head = mHeader->head;
+
+  uint64_t pos = head;
+  for (int i = 0; i < iovcnt; i++) {
+    const uint8_t* src = (const uint8_t*)iov[i].iov_base;
+    size_t n = iov[i].iov_len;
+    while (n > 0) {
+      uint32_t offset = pos & (mDataSize - 1);
+      size_t chunk = mDataSize - offset;
+      if (chunk > n)
+        chunk = n;
+      memcpy(mData + offset, src, chunk);
+      src += chunk;
+      pos += chunk;
+      n -= chunk;
+    }
+  }
+
+  __atomic_store_n(&mHeader->head, head + len, __ATOMIC_RELEASE);
+  // pairs with the consumer setting consumerWaiting then re-reading head
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&mHeader->consumerWaiting, __ATOMIC_RELAXED)) {
+    kick();
+  }
+  return 0;
+}
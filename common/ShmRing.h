@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "display_protocol.h"
+
+// Producer side of the single producer single consumer ring described in
+// display_protocol.h.
+class ShmRing {
+ public:
+  ShmRing();
+  ~ShmRing();
+
+  int create(uint32_t dataSize);
+  int shmFd() const { return mShmFd; }
+  int doorbellFd() const { return mDoorbellFd; }
+  uint32_t shmSize() const { return mShmSize; }
+  uint32_t dataOffset() const { return sizeof(shm_ring_header_t); }
+  uint32_t dataSize() const { return mDataSize; }
+
+  // Free space as of now, only write() takes it so it can only grow until
+  // the next write.
+  size_t space() const;
+  // write one event, returns -1 without waiting if it doesn't fit, the
+  // consumer is then stalled and the ring can't be trusted any more
+  int write(const struct iovec* iov, int iovcnt);
+
+ private:
+  void kick();
+
+ private:
+  int mShmFd = -1;
+  int mDoorbellFd = -1;
+  uint32_t mShmSize = 0;
+  uint32_t mDataSize = 0;
+  shm_ring_header_t* mHeader = nullptr;
+  uint8_t* mData = nullptr;
+};
+
+#endif  // __SHM_RING_H__
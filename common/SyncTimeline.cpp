@@ -0,0 +1,98 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "SyncTimeline.h"
+
+// sw_sync uapi, not exported in the kernel headers
+typedef struct _sw_sync_fence_data_t {
+  uint32_t value;
+  char name[32];
+  int32_t fence;
+} sw_sync_fence_data_t;
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE \
+  _IOWR(SW_SYNC_IOC_MAGIC, 0, sw_sync_fence_data_t)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+SyncTimeline::~SyncTimeline() {
+  if (mFd >= 0) {
+    // the kernel signals the fences left on the timeline
+    close(mFd);
+    mFd = -1;
+  }
+}
+
+int SyncTimeline::init() {
+  ALOGV("SyncTimeline::%s", __func__);
+
+  if (mFd >= 0)
+    return 0;
+
+  const char* paths[] = {"/sys/kernel/debug/sync/sw_sync", "/dev/sw_sync"};
+  for (auto path : paths) {
+    mFd = open(path, O_RDWR | O_CLOEXEC);
+    if (mFd >= 0)
+      return 0;
+  }
+  ALOGW("No sw_sync timeline available:%s", strerror(errno));
+  return -1;
+}
+
+int SyncTimeline::createFence(uint32_t value) {
+  if (mFd < 0)
+    return -1;
+
+  sw_sync_fence_data_t data;
+  memset(&data, 0, sizeof(data));
+  data.value = value;
+  strncpy(data.name, "hwc_vhal", sizeof(data.name) - 1);
+  if (ioctl(mFd, SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+    ALOGE("Failed to create fence:%s", strerror(errno));
+    return -1;
+  }
+  return data.fence;
+}
+
+int SyncTimeline::signal(uint32_t value) {
+  if (mFd < 0)
+    return -1;
+
+  uint32_t inc = value - mValue;
+  if (inc == 0 || inc > 0x80000000u)
+    return 0;
+
+  if (ioctl(mFd, SW_SYNC_IOC_INC, &inc) < 0) {
+    ALOGE("Failed to signal timeline:%s", strerror(errno));
+    return -1;
+  }
+  mValue = value;
+  return 0;
+}
@@ -0,0 +1,46 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __SYNC_TIMELINE_H__
+#define __SYNC_TIMELINE_H__
+
+#include <stdint.h>
+
+// Software sync timeline, for fences signaled by work the hwc does itself.
+// Fences are created for a point on the timeline and signal once the timeline
+// has been advanced to it.
+class SyncTimeline {
+ public:
+  SyncTimeline() {}
+  ~SyncTimeline();
+
+  // -1 if the kernel has no sw_sync
+  int init();
+  bool valid() const { return mFd >= 0; }
+  int createFence(uint32_t value);
+  // signal all fences up to value
+  int signal(uint32_t value);
+
+ private:
+  int mFd = -1;
+  uint32_t mValue = 0;
+};
+
+#endif  // __SYNC_TIMELINE_H__
@@ -0,0 +1,312 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/log.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "VsyncThread.h"
+
+static const int64_t kNsPerSec = 1000 * 1000 * 1000;
+// PLL loop gains, as shifts of the phase error
+static const int kPhaseGainShift = 2;
+static const int kPeriodGainShift = 4;
+// a reference period this far off the current one is taken as a rate change
+static const int kPeriodSnapPercent = 5;
+// references missing for that many periods drop the lock
+static const int kLostPeriods = 4;
+
+VsyncThread::VsyncThread() {}
+
+VsyncThread::~VsyncThread() {
+  stop();
+}
+
+// static
+int64_t VsyncThread::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNsPerSec + ts.tv_nsec;
+}
+
+int VsyncThread::start(Callback cb) {
+  ALOGV("VsyncThread::%s", __func__);
+
+  if (mThread)
+    return 0;
+
+  // non-blocking: the timer can be disarmed between poll and read
+  int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timerFd < 0) {
+    ALOGE("Failed to create vsync timer:%s", strerror(errno));
+    return -1;
+  }
+  mStopFd = eventfd(0, EFD_CLOEXEC);
+  if (mStopFd < 0) {
+    ALOGE("Failed to create vsync stop event:%s", strerror(errno));
+    close(timerFd);
+    return -1;
+  }
+  mCallback = cb;
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mMutex);
+    mTimerFd = timerFd;
+    arm();
+  }
+  mThread = std::unique_ptr<std::thread>(
+      new std::thread(&VsyncThread::threadProc, this));
+  return 0;
+}
+
+void VsyncThread::stop() {
+  ALOGV("VsyncThread::%s", __func__);
+
+  if (mThread) {
+    uint64_t one = 1;
+    write(mStopFd, &one, sizeof(one));
+    mThread->join();
+    mThread = nullptr;
+  }
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mMutex);
+    if (mTimerFd >= 0) {
+      close(mTimerFd);
+      mTimerFd = -1;
+    }
+  }
+  if (mStopFd >= 0) {
+    close(mStopFd);
+    mStopFd = -1;
+  }
+}
+
+void VsyncThread::setEnabled(bool enabled) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  if (mEnabled != enabled) {
+    mEnabled = enabled;
+    mLastVsync = 0;
+    arm();
+  }
+}
+
+void VsyncThread::setPeriod(uint32_t periodNs) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  mNominalPeriod = periodNs ? periodNs : mNominalPeriod;
+  if (!mLastReference && mPeriod != mNominalPeriod) {
+    // keep the phase of the last vsync
+    if (mNextVsync)
+      mPhase = mNextVsync - mPeriod;
+    mPeriod = mNominalPeriod;
+    arm();
+  }
+}
+
+int64_t VsyncThread::changePeriod(uint32_t periodNs, int64_t when) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  int64_t t = now();
+  if (when > t)
+    t = when;
+
+  // first vsync on the current grid at or after t
+  int64_t n = t > mPhase ? (t - mPhase + mPeriod - 1) / mPeriod : 0;
+  int64_t switchTime = mPhase + n * mPeriod;
+
+  if (!mEnabled || mTimerFd < 0) {
+    // no vsync to wait for
+    mNominalPeriod = periodNs;
+    mPeriod = periodNs;
+    mLastReference = 0;
+    mPendingPeriod = 0;
+    mPhase = switchTime;
+    arm();
+    return switchTime;
+  }
+
+  mPendingPeriod = periodNs;
+  mPendingPeriodTime = switchTime;
+  return switchTime + periodNs;
+}
+
+uint32_t VsyncThread::period() {
+  std::unique_lock<std::mutex> lk(mMutex);
+  return mPeriod;
+}
+
+void VsyncThread::addReference(int64_t timestamp, uint32_t periodNs) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  int64_t diff = periodNs > mPeriod ? periodNs - mPeriod : mPeriod - periodNs;
+  if (!mLastReference ||
+      (periodNs && diff * 100 > (int64_t)mPeriod * kPeriodSnapPercent)) {
+    // (re)acquire the lock straight on the reference
+    ALOGV("VsyncThread lock on reference, period %u -> %u", mPeriod,
+          periodNs ? periodNs : mPeriod);
+    mPeriod = periodNs ? periodNs : mPeriod;
+    mPhase = timestamp;
+    mLastReference = timestamp;
+    arm();
+    return;
+  }
+
+  // error against the nearest predicted vsync, in [-period/2, period/2]
+  int64_t elapsed = timestamp - mPhase;
+  int64_t n = (elapsed + (elapsed >= 0 ? 1 : -1) * (int64_t)mPeriod / 2) /
+              (int64_t)mPeriod;
+  int64_t predicted = mPhase + n * mPeriod;
+  int64_t error = timestamp - predicted;
+
+  // spread the frequency correction over the periods since the last reference
+  int64_t periods = (timestamp - mLastReference + mPeriod / 2) / mPeriod;
+  if (periods < 1)
+    periods = 1;
+  int64_t period = mPeriod + (error >> kPeriodGainShift) / periods;
+  int64_t limit = (int64_t)mNominalPeriod * 2;
+  if (period > mNominalPeriod / 2 && period < limit)
+    mPeriod = period;
+
+  mPhase = predicted + (error >> kPhaseGainShift);
+  mLastReference = timestamp;
+  arm();
+}
+
+void VsyncThread::resetReference() {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  if (mLastReference)
+    unlock(mNextVsync ? mNextVsync - mPeriod : now());
+}
+
+// called with mMutex held
+void VsyncThread::unlock(int64_t timestamp) {
+  mLastReference = 0;
+  mPeriod = mNominalPeriod;
+  mPhase = timestamp;
+  arm();
+}
+
+void VsyncThread::setPhase(int64_t timestamp) {
+  std::unique_lock<std::mutex> lk(mMutex);
+
+  mPhase = timestamp;
+  arm();
+}
+
+// called with mMutex held
+int VsyncThread::arm() {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+
+  if (mTimerFd < 0)
+    return -1;
+
+  if (mEnabled) {
+    // First deadline on the phase grid after the last vsync delivered, so a
+    // reference moving the phase doesn't push the pending vsync a period
+    // later. A deadline already past fires at once. Once enabled again it is
+    // the first one in the future.
+    int64_t t = mLastVsync ? mLastVsync + mPeriod / 2 : now();
+    int64_t n = (t - mPhase) / mPeriod + 1;
+    if (t < mPhase)
+      n = 0;
+    mNextVsync = mPhase + n * mPeriod;
+    spec.it_value.tv_sec = mNextVsync / kNsPerSec;
+    spec.it_value.tv_nsec = mNextVsync % kNsPerSec;
+    spec.it_interval.tv_sec = mPeriod / kNsPerSec;
+    spec.it_interval.tv_nsec = mPeriod % kNsPerSec;
+  }
+  if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+    ALOGE("Failed to arm vsync timer:%s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void VsyncThread::threadProc() {
+  struct pollfd fds[2] = {
+      {mTimerFd, POLLIN, 0},
+      {mStopFd, POLLIN, 0},
+  };
+
+  while (true) {
+    int ret = poll(fds, 2, -1);
+    if (ret < 0) {
+      if (errno != EINTR) {
+        ALOGE("Vsync poll failed:%s", strerror(errno));
+        return;
+      }
+      continue;
+    }
+    if (fds[1].revents & POLLIN)
+      break;
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    int64_t timestamp;
+    uint32_t period;
+    {
+      // read under the lock, expirations then count from mNextVsync as
+      // last armed
+      std::unique_lock<std::mutex> lk(mMutex);
+      uint64_t expirations = 0;
+      ssize_t n = read(mTimerFd, &expirations, sizeof(expirations));
+      if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        ALOGE("Vsync timer read failed:%s", strerror(errno));
+        return;
+      }
+      if (n != sizeof(expirations) || expirations == 0) {
+        // disarmed or re-armed meanwhile
+        continue;
+      }
+      if (!mEnabled)
+        continue;
+      // report the last deadline that expired, missed ones are skipped
+      mNextVsync += expirations * mPeriod;
+      timestamp = mNextVsync - mPeriod;
+      period = mPeriod;
+      mLastVsync = timestamp;
+
+      if (mPendingPeriod && timestamp + mPeriod / 2 >= mPendingPeriodTime) {
+        ALOGV("VsyncThread period %u -> %u", mPeriod, mPendingPeriod);
+        // the reference, if any, relocks on the new rate
+        mNominalPeriod = mPendingPeriod;
+        mPendingPeriod = 0;
+        unlock(timestamp);
+      } else if (mLastReference && timestamp - mLastReference >
+                                       (int64_t)kLostPeriods * mPeriod) {
+        ALOGD("VsyncThread lost reference vsync, back to local timer");
+        unlock(timestamp);
+      }
+    }
+    if (mCallback) {
+      mCallback(timestamp, period);
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __VSYNC_THREAD_H__
+#define __VSYNC_THREAD_H__
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Software vsync source. A timerfd on CLOCK_MONOTONIC is armed with absolute
+// deadlines anchored on a phase, so callbacks don't drift, and it is disarmed
+// while vsync is disabled so an idle display never wakes up.
+//
+// When reference timestamps are fed in (vsync events of the remote encoder),
+// a PLL locks phase and period onto them, smoothing their jitter. If they
+// stop for a few periods the timer runs free at the nominal period again.
+class VsyncThread {
+ public:
+  typedef std::function<void(int64_t timestamp, uint32_t period)> Callback;
+
+  VsyncThread();
+  ~VsyncThread();
+
+  int start(Callback cb);
+  void stop();
+  void setEnabled(bool enabled);
+  bool started() const { return mThread != nullptr; }
+  // nominal period, used when not locked to a reference
+  void setPeriod(uint32_t periodNs);
+  // switch the nominal period at the first vsync at or after when, returns
+  // the time of the first vsync spaced by the new period
+  int64_t changePeriod(uint32_t periodNs, int64_t when);
+  // move the vsync phase so that a vsync happens at timestamp
+  void setPhase(int64_t timestamp);
+  // reference vsync, period is 0 if unknown
+  void addReference(int64_t timestamp, uint32_t periodNs);
+  // drop the lock and run at the nominal period
+  void resetReference();
+
+  uint32_t period();
+  static int64_t now();
+
+ private:
+  void threadProc();
+  int arm();
+  void unlock(int64_t timestamp);
+
+ private:
+  int mTimerFd = -1;
+  int mStopFd = -1;
+  Callback mCallback;
+  std::unique_ptr<std::thread> mThread;
+
+  std::mutex mMutex;
+  bool mEnabled = false;
+  uint32_t mNominalPeriod = 1000 * 1000 * 1000 / 60;
+  uint32_t mPeriod = 1000 * 1000 * 1000 / 60;
+  int64_t mPhase = 0;
+  // period switch scheduled by changePeriod, applied at that vsync
+  uint32_t mPendingPeriod = 0;
+  int64_t mPendingPeriodTime = 0;
+  // time of the last reference, 0 if not locked
+  int64_t mLastReference = 0;
+  // deadline the timer was last armed for
+  int64_t mNextVsync = 0;
+  // timestamp of the last vsync delivered since enabled, 0 if none yet
+  int64_t mLastVsync = 0;
+};
+
+#endif  // __VSYNC_THREAD_H__
@@ -34,12 +34,20 @@
 #define DD_EVENT_SERVER_IP_ACK 0x1007
 #define DD_EVENT_SERVER_IP_SET 0x1008
 #define DD_EVENT_SET_ROTATION 0x1009
+#define DD_EVENT_FRAME_BATCH 0x100a
+#define DD_EVENT_SHM_RING_SETUP 0x100b
+#define DD_EVENT_RING_SYNC 0x100c
+#define DD_EVENT_VSYNC 0x100d
+#define DD_EVENT_SET_VSYNC 0x100e
+#define DD_EVENT_SET_CONFIG 0x100f
+#define DD_EVENT_SET_IDLE 0x1010
 
 #define DD_EVENT_CREATE_LAYER 0x1100
 #define DD_EVENT_REMOVE_LAYER 0x1101
 #define DD_EVENT_UPDATE_LAYERS 0x1102
 #define DD_EVENT_PRESENT_LAYERS_REQ 0x1103
 #define DD_EVENT_PRESENT_LAYERS_ACK 0x1104
+#define DD_EVENT_UPDATE_LAYERS_DELTA 0x1105
 
 // define framebuffer id as the max
 #define LAYER_ID_FRAMEBUFFER 0xffffffffffffffff
@@ -52,10 +60,28 @@ typedef struct _display_flags {
       uint32_t mode : 2;  // 0 - legacy, 1 -layers only, 2 - both fb and layers
       uint32_t primaryHotplug : 1;  // Primary can be configured if request size
                                     // doesnt match default
+      uint32_t frameBatch : 1;  // remote accepts DD_EVENT_FRAME_BATCH
+      uint32_t shmRing : 1;     // remote accepts the shared memory ring
+      uint32_t layerDelta : 1;  // remote accepts DD_EVENT_UPDATE_LAYERS_DELTA
+      uint32_t fences : 1;      // remote takes acquire fences, returns release
+      uint32_t remoteVsync : 1;  // remote sends DD_EVENT_VSYNC when enabled
+      uint32_t multiConfig : 1;  // display info is followed by a config list
+      uint32_t idleHint : 1;     // remote accepts DD_EVENT_SET_IDLE
+      uint32_t damage : 1;       // remote takes damage regions of the frames
+      uint32_t maxPlanes : 4;    // mode 2 layers the remote composes itself
+      uint32_t frameSeq : 1;     // acks echo the frame number of requests
     };
   };
 } display_flags;
 
+/*
+ * In mode 2 with maxPlanes set, the hwc gives at most maxPlanes layers their
+ * own plane and SurfaceFlinger composes the others into the framebuffer.
+ * Layers come with their composition type in layer_info_t.type: the Client
+ * ones are those in the framebuffer, which the remote draws at the z of the
+ * lowest of them. Planes are only ever below or above all the Client layers,
+ * and the framebuffer is transparent over the planes below it.
+ */
 typedef struct _display_info_t {
   unsigned int flags;
   unsigned int width;
@@ -70,8 +96,34 @@ typedef struct _display_info_t {
   int numFramebuffers;
 } display_info_t;
 
+/*
+ * With multiConfig, display_info_t in DD_EVENT_DISPINFO_ACK is followed by a
+ * display_config_list_t and numConfigs display_config_t, the modes the remote
+ * can encode. The hwc switches between them with DD_EVENT_SET_CONFIG, taking
+ * effect from the next frame. The info fields are those of activeConfig.
+ */
+#define DISPLAY_MAX_CONFIGS 16
+
+typedef struct _display_config_t {
+  uint32_t width;
+  uint32_t height;
+  float fps;
+  uint32_t pad;
+} display_config_t;
+
+typedef struct _display_config_list_t {
+  uint32_t numConfigs;
+  uint32_t activeConfig;  // index in the list
+} display_config_list_t;
+
+/*
+ * Each event is written with a single sendmsg. For DD_EVENT_CREATE_BUFFER the
+ * native handle fds are attached as SCM_RIGHTS to the first byte of the event,
+ * so the receiver must read the event header with recvmsg and room for the
+ * control message. The 16 bytes trailer after the handle is kept for legacy.
+ */
 typedef struct _buffer_info_t {
-  uint64_t bufferId;
+  uint64_t bufferId;  // opaque id assigned by the hwc, unique per connection
   int data[0];  // local handle
 } buffer_info_t;
 
@@ -97,6 +149,43 @@ typedef struct _rotation_event_t {
   int rotation;
 } rotation_event_t;
 
+/*
+ * With remoteVsync, DD_EVENT_SET_VSYNC starts or stops the DD_EVENT_VSYNC
+ * events, sent by the remote each time its encoder is ready for a new frame.
+ * timestamp is the remote CLOCK_MONOTONIC in ns, or 0 if the remote doesn't
+ * share the clock with Android, in which case the time of arrival is used.
+ * period is the current frame interval of the encoder in ns, 0 if unknown.
+ */
+typedef struct _set_vsync_event_t {
+  display_event_t event;
+  uint32_t enabled;
+  uint32_t pad;
+} set_vsync_event_t;
+
+typedef struct _vsync_event_t {
+  display_event_t event;
+  int64_t timestamp;
+  uint32_t period;
+  uint32_t pad;
+} vsync_event_t;
+
+typedef struct _set_config_event_t {
+  display_event_t event;
+  uint32_t config;  // index in the config list
+  uint32_t pad;
+} set_config_event_t;
+
+/*
+ * With idleHint, DD_EVENT_SET_IDLE with idle set tells the remote that nothing
+ * has been presented for a while and the content is static, so the encoder
+ * may stop producing frames. It is cleared in the batch of the next frame.
+ */
+typedef struct _set_idle_event_t {
+  display_event_t event;
+  uint32_t idle;
+  uint32_t pad;
+} set_idle_event_t;
+
 typedef struct _create_layer_event_t {
   display_event_t event;
   uint64_t layerId;
@@ -128,15 +217,79 @@ typedef struct _layer_info_t {
   int32_t blendMode;
   float planeAlpha;
   uint32_t color;
-  uint32_t changed;
+  uint32_t changed;  // LAYER_FIELD_* mask, non-zero if anything changed
 } layer_info_t;
 
+// fields of layer_info_t, in the order they are packed in a layer delta
+#define LAYER_FIELD_TYPE (1 << 0)         // type
+#define LAYER_FIELD_TASK_INFO (1 << 1)    // stackId, taskId, userId, index
+#define LAYER_FIELD_SRC_CROP (1 << 2)     // srcCrop
+#define LAYER_FIELD_DST_FRAME (1 << 3)    // dstFrame
+#define LAYER_FIELD_TRANSFORM (1 << 4)    // transform
+#define LAYER_FIELD_Z (1 << 5)            // z
+#define LAYER_FIELD_BLEND_MODE (1 << 6)   // blendMode
+#define LAYER_FIELD_PLANE_ALPHA (1 << 7)  // planeAlpha
+#define LAYER_FIELD_COLOR (1 << 8)        // color
+#define LAYER_FIELD_ALL 0x1ff
+
+#define LAYER_DELTA_VERSION 1
+
+/*
+ * Compact form of DD_EVENT_UPDATE_LAYERS: each layer record only carries the
+ * fields set in its dirty mask, packed back to back in LAYER_FIELD_* order
+ * with their layer_info_t types. size is the number of field bytes following
+ * the record, so bits unknown to the receiver can be skipped.
+ */
+typedef struct _layer_delta_t {
+  uint64_t layerId;
+  uint32_t dirty;
+  uint32_t size;
+} layer_delta_t;
+
+typedef struct _update_layers_delta_event_t {
+  display_event_t event;
+  uint32_t version;
+  uint32_t numLayers;
+  // followed by numLayers layer_delta_t records and their fields
+} update_layers_delta_event_t;
+
 typedef struct _update_layers_event_t {
   display_event_t event;
   uint32_t numLayers;
   layer_info_t layers[0];
 } update_layers_event_t;
 
+/*
+ * With the damage flag, DD_EVENT_DISPLAY_REQ is followed by the damage region
+ * of the buffer, and DD_EVENT_PRESENT_LAYERS_REQ by one region per layer, in
+ * the order of the layers. Rects are in buffer coordinates. No rect means the
+ * whole buffer changed, a single empty rect that nothing did. When there are
+ * more than DAMAGE_MAX_RECTS rects their bounding box is sent instead.
+ */
+#define DAMAGE_MAX_RECTS 16
+
+typedef struct _damage_region_t {
+  uint32_t numRects;
+  uint32_t pad;
+  rect_t rects[0];
+} damage_region_t;
+
+/*
+ * With the fences flag, DD_EVENT_PRESENT_LAYERS_REQ attaches the acquire fences
+ * of the layers as SCM_RIGHTS and fence is the index of the layer's fence in
+ * them, or -1 if the buffer is ready. The remote does the same in
+ * DD_EVENT_PRESENT_LAYERS_ACK: releaseFence is the index of a fence signaled
+ * when the frame is on screen, and each layer fence the index of a fence
+ * signaled when the remote is done reading that layer's buffer.
+ *
+ * The hwc numbers its frames and puts the number in event.id of
+ * DD_EVENT_DISPLAY_REQ and DD_EVENT_PRESENT_LAYERS_REQ. With frameSeq the
+ * remote echoes it in event.id of the matching DD_EVENT_DISPLAY_ACK and
+ * DD_EVENT_PRESENT_LAYERS_ACK, otherwise acks are taken to come in the order
+ * of the requests. Fences of a frame not acked yet are stood in for by the
+ * hwc and signaled when its last ack comes, so with the fences flag the
+ * remote must ack every request, once the frame is on screen.
+ */
 typedef struct _layer_buffer_info_t {
   uint64_t layerId;
   uint64_t bufferId;
@@ -158,4 +311,51 @@ typedef struct _present_layers_ack_event_t {
   layer_buffer_info_t layers[0];
 } present_layers_ack_event_t;
 
+/*
+ * All events produced by one present are sent in a single envelope. It is
+ * followed by numEvents complete events packed back to back, each one starting
+ * with its display_event_t and occupying exactly event.size bytes (no legacy
+ * trailer, no alignment padding). Fds of the inner events are attached to the
+ * envelope in the order the events appear.
+ */
+typedef struct _frame_batch_event_t {
+  display_event_t event;
+  uint32_t numEvents;
+  uint32_t numFds;
+} frame_batch_event_t;
+
+/*
+ * Shared memory ring transport, negotiated after DD_EVENT_DISPINFO_ACK when
+ * the remote sets shmRing. DD_EVENT_SHM_RING_SETUP carries two fds: a memfd
+ * holding shm_ring_header_t followed by the data area, and an eventfd used as
+ * doorbell. From then on the hwc writes its events into the ring instead of
+ * the socket, in the same format and possibly wrapping around the end of the
+ * data area. Events that carry fds or don't fit the data area still go
+ * through the socket, and for each of them a DD_EVENT_RING_SYNC is queued in
+ * the ring: when the consumer reads it, it must process the next event from
+ * the socket before going on. A consumer that lets the ring fill up is
+ * disconnected.
+ *
+ * head is only written by the hwc, tail only by the remote, both are byte
+ * counts that never wrap. The consumer sets consumerWaiting before blocking on
+ * the doorbell (and re-checks head), the hwc only kicks the doorbell when it
+ * sees the flag set. The consumer clears it once woken up.
+ */
+#define SHM_RING_MAGIC 0x474e4952
+
+typedef struct _shm_ring_header_t {
+  uint32_t magic;
+  uint32_t size;  // size of the data area, power of 2
+  uint32_t consumerWaiting;
+  uint32_t pad;
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64))) shm_ring_header_t;
+
+typedef struct _shm_ring_setup_event_t {
+  display_event_t event;
+  uint32_t size;  // total size of the memfd
+  uint32_t dataOffset;
+} shm_ring_setup_event_t;
+
 #endif  // _H_DISPLAY_PROTOCOL_
@@ -38,6 +38,8 @@ int Hwc1Display::init(RemoteDisplay* rd) {
   ALOGV("Hwc2Display(%d)::%s", mDisplayID, __func__);
 
   mRemoteDisplay = rd;
+  mFbtBuffers.setRemoteDisplay(rd);
+  mAppBuffers.setRemoteDisplay(rd);
   mWidth = mRemoteDisplay->width();
   mHeight = mRemoteDisplay->height();
   mFramerate = mRemoteDisplay->fps();
@@ -188,18 +190,10 @@ int Hwc1Display::set(hwc_display_contents_1_t* disp) {
   buffer_handle_t buffer = disp->hwLayers[disp->numHwLayers - 1].handle;
 
   if (mRemoteDisplay && buffer) {
-    bool isNew = true;
-
-    for (auto fbt : mFbtBuffers) {
-      if (buffer == fbt) {
-        isNew = false;
-      }
+    uint64_t id = mFbtBuffers.use(buffer);
+    if (id) {
+      mRemoteDisplay->displayBuffer(id);
     }
-    if (isNew) {
-      mFbtBuffers.push_back(buffer);
-      mRemoteDisplay->createBuffer(buffer);
-    }
-    mRemoteDisplay->displayBuffer(buffer);
   }
   return 0;
 }
@@ -231,18 +225,10 @@ void Hwc1Display::dumpLayer(size_t idx, hwc_layer_1_t const* l) {
 int Hwc1Display::setSingleLayerBuffer(buffer_handle_t b) {
   ALOGV("Hwc1Display::setSingleLayerBuffer");
 
-  bool isNew = true;
-
-  for (auto ab : mAppBuffers) {
-    if (ab == b) {
-      isNew = false;
-    }
-  }
-  if (isNew) {
-    mAppBuffers.push_back(b);
-    mRemoteDisplay->createBuffer(b);
+  uint64_t id = mAppBuffers.use(b);
+  if (id) {
+    mRemoteDisplay->displayBuffer(id);
   }
-  mRemoteDisplay->displayBuffer(b);
 
   return 0;
 }
@@ -250,11 +236,6 @@ int Hwc1Display::setSingleLayerBuffer(buffer_handle_t b) {
 int Hwc1Display::exitSingleLayer() {
   ALOGV("Hwc1Display::exitSingleLayer");
 
-  if (mRemoteDisplay) {
-    for (auto b : mAppBuffers) {
-      mRemoteDisplay->removeBuffer(b);
-    }
-    mAppBuffers.clear();
-  }
+  mAppBuffers.clear();
   return 0;
 }
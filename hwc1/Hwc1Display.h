@@ -72,10 +72,10 @@ class Hwc1Display {
 
   // remote display
   RemoteDisplay* mRemoteDisplay = nullptr;
-  std::vector<buffer_handle_t> mFbtBuffers;
+  RemoteBufferSet mFbtBuffers{4};
 
   bool mEnableSingleLayerOpt = false;
   bool mSingleLayer = false;
-  std::vector<buffer_handle_t> mAppBuffers;
+  RemoteBufferSet mAppBuffers{8};
 };
 #endif  //__HWC1_DISPLAY_H__
@@ -0,0 +1,475 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sync/sync.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "BufferMapper.h"
+#include "Hwc2Compositor.h"
+#include "PixelKernels.h"
+
+using namespace HWC2;
+
+namespace {
+
+bool isEmpty(const rect_t& r) {
+  return r.right <= r.left || r.bottom <= r.top;
+}
+
+rect_t intersect(const rect_t& a, const rect_t& b) {
+  rect_t r = {std::max(a.left, b.left), std::max(a.top, b.top),
+              std::min(a.right, b.right), std::min(a.bottom, b.bottom)};
+  return r;
+}
+
+void unite(rect_t& a, const rect_t& b) {
+  if (isEmpty(b))
+    return;
+  if (isEmpty(a)) {
+    a = b;
+    return;
+  }
+  a.left = std::min(a.left, b.left);
+  a.top = std::min(a.top, b.top);
+  a.right = std::max(a.right, b.right);
+  a.bottom = std::max(a.bottom, b.bottom);
+}
+
+bool sameRect(const rect_t& a, const rect_t& b) {
+  return a.left == b.left && a.top == b.top && a.right == b.right &&
+         a.bottom == b.bottom;
+}
+
+uint8_t planeAlpha(float alpha) {
+  if (alpha <= 0.0f)
+    return 0;
+  if (alpha >= 1.0f)
+    return 255;
+  return (uint8_t)(alpha * 255 + 0.5f);
+}
+
+}  // namespace
+
+Hwc2Compositor::~Hwc2Compositor() {
+  releaseBuffers();
+}
+
+Hwc2Compositor::Source::~Source() {
+  if (handle) {
+    BufferMapper::getMapper().release(handle);
+  }
+}
+
+std::shared_ptr<Hwc2Compositor::Source> Hwc2Compositor::getSource(
+    buffer_handle_t b) {
+  RemoteDisplay::BufferKey key;
+  if (RemoteDisplay::getBufferKey(b, key) < 0)
+    return nullptr;
+
+  for (size_t i = 0; i < mSources.size(); i++) {
+    if (mSources[i]->key == key) {
+      auto source = mSources[i];
+      mSources.erase(mSources.begin() + i);
+      mSources.insert(mSources.begin(), source);
+      return source;
+    }
+  }
+
+  auto& mapper = BufferMapper::getMapper();
+  std::shared_ptr<Source> source(new Source());
+  source->key = key;
+  if (mapper.importBuffer(b, &source->handle) < 0) {
+    ALOGE("Failed to import layer buffer %p", b);
+    source->handle = nullptr;
+    return nullptr;
+  }
+  BufferMapper::BufferInfo info;
+  if (mapper.describe(source->handle, info) < 0) {
+    return nullptr;
+  }
+  source->width = info.width;
+  source->height = info.height;
+  source->stride = info.stride;
+  source->format = info.format;
+
+  if (mSources.size() >= kMaxSources) {
+    mSources.pop_back();
+  }
+  mSources.insert(mSources.begin(), source);
+  return source;
+}
+
+bool Hwc2Compositor::acceptBuffer(Hwc2Layer& layer) {
+  const layer_info_t& info = layer.info();
+  if (info.transform != 0 || !layer.buffer())
+    return false;
+
+  auto blend = static_cast<BlendMode>(info.blendMode);
+  if (blend != BlendMode::None && blend != BlendMode::Premultiplied &&
+      blend != BlendMode::Coverage)
+    return false;
+  // no blending ignores the pixel alpha but not the plane alpha
+  if (blend == BlendMode::None && planeAlpha(info.planeAlpha) != 255)
+    return false;
+
+  // whole pixels of the buffer, scaled up by integer factors
+  const hwc_frect_t& crop = layer.sourceCrop();
+  const rect_t& c = info.srcCrop;
+  const rect_t& d = info.dstFrame;
+  if (crop.left != c.left || crop.top != c.top || crop.right != c.right ||
+      crop.bottom != c.bottom || isEmpty(c) || isEmpty(d))
+    return false;
+  int cw = c.right - c.left, ch = c.bottom - c.top;
+  int dw = d.right - d.left, dh = d.bottom - d.top;
+  if (dw < cw || dh < ch || dw % cw || dh % ch)
+    return false;
+
+  auto source = getSource(layer.buffer());
+  if (!source)
+    return false;
+  if (source->format != HAL_PIXEL_FORMAT_RGBA_8888 &&
+      source->format != HAL_PIXEL_FORMAT_RGBX_8888 &&
+      source->format != HAL_PIXEL_FORMAT_BGRA_8888)
+    return false;
+  if (c.left < 0 || c.top < 0 || (uint32_t)c.right > source->width ||
+      (uint32_t)c.bottom > source->height)
+    return false;
+  return true;
+}
+
+bool Hwc2Compositor::acceptLayer(Hwc2Layer& layer, uint64_t& area) {
+  const rect_t& d = layer.info().dstFrame;
+  auto type = layer.type();
+  if (type == Composition::SolidColor) {
+    if (isEmpty(d))
+      return false;
+  } else if (type == Composition::Device || type == Composition::Cursor) {
+    if (!acceptBuffer(layer))
+      return false;
+  } else {
+    return false;
+  }
+
+  rect_t screen = {0, 0, (int)mWidth, (int)mHeight};
+  rect_t visible = intersect(d, screen);
+  if (!isEmpty(visible)) {
+    area += (uint64_t)(visible.right - visible.left) *
+            (visible.bottom - visible.top);
+  }
+  return true;
+}
+
+bool Hwc2Compositor::accept(const std::vector<Hwc2Layer*>& layers,
+                            uint32_t width,
+                            uint32_t height) {
+  if (layers.empty() || !width || !height)
+    return false;
+
+  if (width != mWidth || height != mHeight) {
+    releaseBuffers();
+    mWidth = width;
+    mHeight = height;
+  }
+
+  uint64_t area = 0;
+  for (auto layer : layers) {
+    if (!acceptLayer(*layer, area))
+      return false;
+  }
+  return area <= (uint64_t)kMaxOverdraw * width * height;
+}
+
+void Hwc2Compositor::addFrameDamage(const std::vector<Hwc2Layer*>& layers,
+                                    rect_t& damage) {
+  std::vector<LayerState> states;
+  states.reserve(layers.size());
+  for (auto layer : layers) {
+    const layer_info_t& info = layer->info();
+    states.push_back({info.layerId, info.type, info.dstFrame, info.srcCrop,
+                      info.blendMode, info.planeAlpha, info.color, info.z,
+                      layer->buffer(), layer->bufferSeq()});
+  }
+
+  std::vector<bool> seen(mLastLayers.size(), false);
+  for (size_t i = 0; i < states.size(); i++) {
+    const LayerState& s = states[i];
+    size_t j = 0;
+    while (j < mLastLayers.size() && mLastLayers[j].id != s.id)
+      j++;
+    if (j == mLastLayers.size()) {
+      unite(damage, s.dst);
+      continue;
+    }
+    seen[j] = true;
+    const LayerState& last = mLastLayers[j];
+    if (s.type != last.type || !sameRect(s.dst, last.dst) ||
+        !sameRect(s.crop, last.crop) || s.blendMode != last.blendMode ||
+        s.alpha != last.alpha || s.color != last.color || s.z != last.z ||
+        s.buffer != last.buffer) {
+      unite(damage, last.dst);
+      unite(damage, s.dst);
+    } else if (s.buffer && s.bufferSeq != last.bufferSeq) {
+      // new content in the same buffer, the surface damage is in buffer
+      // coordinates
+      const RemoteDisplay::Damage& surface = layers[i]->damage();
+      if (surface.empty()) {
+        unite(damage, s.dst);
+        continue;
+      }
+      int kx = (s.dst.right - s.dst.left) / (s.crop.right - s.crop.left);
+      int ky = (s.dst.bottom - s.dst.top) / (s.crop.bottom - s.crop.top);
+      for (auto& r : surface) {
+        rect_t mapped = {s.dst.left + (r.left - s.crop.left) * kx,
+                         s.dst.top + (r.top - s.crop.top) * ky,
+                         s.dst.left + (r.right - s.crop.left) * kx,
+                         s.dst.top + (r.bottom - s.crop.top) * ky};
+        unite(damage, intersect(mapped, s.dst));
+      }
+    }
+  }
+  for (size_t j = 0; j < mLastLayers.size(); j++) {
+    if (!seen[j]) {
+      unite(damage, mLastLayers[j].dst);
+    }
+  }
+  mLastLayers.swap(states);
+}
+
+// the color isn't premultiplied, its alpha and the plane alpha both apply
+void Hwc2Compositor::drawColor(Hwc2Layer& layer,
+                               uint8_t* dst,
+                               uint32_t dstStride,
+                               const rect_t& r) {
+  uint32_t color = layer.color();
+  uint8_t alpha = planeAlpha(layer.info().planeAlpha);
+  uint32_t n = r.right - r.left;
+  uint8_t* out = dst + r.top * dstStride + r.left * 4;
+  if (alpha == 255 && (color >> 24) == 255) {
+    PixelKernels::fill(out, dstStride, n, r.bottom - r.top, color);
+    return;
+  }
+  if (mRow.size() < n * 4) {
+    mRow.resize(n * 4);
+  }
+  PixelKernels::fill(mRow.data(), 0, n, 1, color);
+  PixelKernels::blend(out, dstStride, mRow.data(), 0, n, r.bottom - r.top,
+                      alpha, false);
+}
+
+int Hwc2Compositor::drawLayer(Hwc2Layer& layer,
+                              uint8_t* dst,
+                              uint32_t dstStride,
+                              const rect_t& region) {
+  const layer_info_t& info = layer.info();
+  const rect_t& d = info.dstFrame;
+  const rect_t& c = info.srcCrop;
+  rect_t r = intersect(d, region);
+  if (isEmpty(r))
+    return 0;
+  if (layer.type() == Composition::SolidColor) {
+    drawColor(layer, dst, dstStride, r);
+    return 0;
+  }
+
+  auto source = getSource(layer.buffer());
+  if (!source)
+    return -1;
+  if (layer.acquireFence() >= 0 &&
+      sync_wait(layer.acquireFence(), 1000) < 0) {
+    ALOGE("Wait for layer %" PRIu64 " buffer failed", info.layerId);
+    return -1;
+  }
+  auto& mapper = BufferMapper::getMapper();
+  uint8_t* data = nullptr;
+  if (mapper.lockBuffer(source->handle, source->width, source->height, data) <
+      0) {
+    return -1;
+  }
+
+  int kx = (d.right - d.left) / (c.right - c.left);
+  int ky = (d.bottom - d.top) / (c.bottom - c.top);
+  uint32_t n = r.right - r.left;
+  uint32_t srcStride = source->stride * 4;
+  auto blend = static_cast<BlendMode>(info.blendMode);
+  uint8_t alpha = planeAlpha(info.planeAlpha);
+  bool rgbx = source->format == HAL_PIXEL_FORMAT_RGBX_8888;
+  bool opaque = blend == BlendMode::None || (rgbx && alpha == 255);
+  if (mRow.size() < n * 4) {
+    mRow.resize(n * 4);
+  }
+  uint8_t* row = mRow.data();
+
+  for (int y = r.top; y < r.bottom; y++) {
+    const uint8_t* s = data + (c.top + (y - d.top) / ky) * srcStride;
+    if (kx == 1) {
+      s += (c.left + r.left - d.left) * 4;
+    } else {
+      for (uint32_t i = 0; i < n; i++) {
+        memcpy(row + i * 4, s + (c.left + (r.left + i - d.left) / kx) * 4, 4);
+      }
+      s = row;
+    }
+    if (source->format == HAL_PIXEL_FORMAT_BGRA_8888) {
+      PixelKernels::swizzle(row, 0, s, 0, n, 1);
+      s = row;
+    }
+
+    uint8_t* out = dst + y * dstStride + r.left * 4;
+    if (opaque) {
+      PixelKernels::fillAlpha(out, 0, s, 0, n, 1);
+    } else {
+      if (rgbx) {
+        PixelKernels::fillAlpha(row, 0, s, 0, n, 1);
+        s = row;
+      }
+      PixelKernels::blend(out, 0, s, 0, n, 1, alpha,
+                          blend == BlendMode::Premultiplied);
+    }
+  }
+
+  mapper.unlockBuffer(source->handle);
+  return 0;
+}
+
+int Hwc2Compositor::compose(const std::vector<Hwc2Layer*>& layers,
+                            buffer_handle_t& out,
+                            RemoteDisplay::Damage& damage) {
+  rect_t screen = {0, 0, (int)mWidth, (int)mHeight};
+  rect_t frameDamage = {0, 0, 0, 0};
+  addFrameDamage(layers, frameDamage);
+  frameDamage = mFullDamage ? screen : intersect(frameDamage, screen);
+
+  damage.clear();
+  if (isEmpty(frameDamage) && mLastOutput >= 0) {
+    out = mOutputs[mLastOutput].handle;
+    damage.push_back({0, 0, 0, 0});
+    return 0;
+  }
+  for (auto& o : mOutputs) {
+    unite(o.dirty, frameDamage);
+  }
+
+  int index = (mLastOutput + 1) % kNumOutputs;
+  Output& o = mOutputs[index];
+  auto& mapper = BufferMapper::getMapper();
+  if (!o.handle) {
+    if (mapper.allocate(mWidth, mHeight, HAL_PIXEL_FORMAT_RGBA_8888,
+                        &o.handle) < 0) {
+      o.handle = nullptr;
+      reset();
+      return -1;
+    }
+    BufferMapper::BufferInfo info;
+    if (mapper.describe(o.handle, info) < 0) {
+      mapper.release(o.handle);
+      o.handle = nullptr;
+      reset();
+      return -1;
+    }
+    o.stride = info.stride;
+    o.dirty = screen;
+    // the remote hasn't seen this buffer yet
+    frameDamage = screen;
+  }
+  if (o.releaseFence >= 0) {
+    sync_wait(o.releaseFence, 1000);
+    close(o.releaseFence);
+    o.releaseFence = -1;
+  }
+
+  // on failure the frame isn't shown, nor is any output up to date with the
+  // layers taken as last drawn
+  uint8_t* data = nullptr;
+  if (mapper.lockBuffer(o.handle, mWidth, mHeight, data) < 0) {
+    reset();
+    return -1;
+  }
+  uint32_t stride = o.stride * 4;
+  const rect_t& r = o.dirty;
+  for (int y = r.top; y < r.bottom; y++) {
+    memset(data + y * stride + r.left * 4, 0, (r.right - r.left) * 4);
+  }
+  int ret = 0;
+  for (auto layer : layers) {
+    if (drawLayer(*layer, data, stride, r) < 0) {
+      ret = -1;
+    }
+  }
+  mapper.unlockBuffer(o.handle);
+  if (ret < 0) {
+    reset();
+    return -1;
+  }
+  o.dirty = {0, 0, 0, 0};
+
+  mLastOutput = index;
+  mFullDamage = false;
+  out = o.handle;
+  if (!sameRect(frameDamage, screen)) {
+    damage.push_back(frameDamage);
+  }
+  return 0;
+}
+
+void Hwc2Compositor::setReleaseFence(int fence) {
+  if (mLastOutput < 0) {
+    if (fence >= 0) {
+      close(fence);
+    }
+    return;
+  }
+  Output& o = mOutputs[mLastOutput];
+  if (o.releaseFence >= 0) {
+    close(o.releaseFence);
+  }
+  o.releaseFence = fence;
+}
+
+void Hwc2Compositor::reset() {
+  mLastLayers.clear();
+  rect_t screen = {0, 0, (int)mWidth, (int)mHeight};
+  for (auto& o : mOutputs) {
+    o.dirty = screen;
+  }
+  mFullDamage = true;
+}
+
+void Hwc2Compositor::releaseBuffers() {
+  auto& mapper = BufferMapper::getMapper();
+  for (auto& o : mOutputs) {
+    if (o.releaseFence >= 0) {
+      close(o.releaseFence);
+    }
+    if (o.handle) {
+      mapper.release(o.handle);
+    }
+    o = Output();
+  }
+  mLastOutput = -1;
+  mFullDamage = true;
+  mLastLayers.clear();
+  mSources.clear();
+}
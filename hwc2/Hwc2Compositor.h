@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __HWC2_COMPOSITOR_H__
+#define __HWC2_COMPOSITOR_H__
+
+#include <memory>
+#include <vector>
+
+#include "Hwc2Layer.h"
+#include "RemoteDisplay.h"
+
+// Composes frames of simple layers on the cpu into RGBA_8888 buffers owned
+// by the hwc, instead of having them go through client composition on the
+// guest GPU. Layers are taken when they are solid colors or RGBA, RGBX or
+// BGRA buffers without transform, scaled up by integer factors at most, and
+// the frame doesn't overdraw too much. Each output buffer only gets the area
+// that changed since it was last drawn redrawn.
+class Hwc2Compositor {
+ public:
+  Hwc2Compositor() {}
+  ~Hwc2Compositor();
+
+  // whether the layers, in z order, can be composed into a frame of the size
+  bool accept(const std::vector<Hwc2Layer*>& layers,
+              uint32_t width,
+              uint32_t height);
+  // Draws the layers accepted last into the next output buffer. damage is
+  // what changed since the previous output, a single empty rect if nothing
+  // did, and then the previous output is returned again. On failure out is
+  // left alone and the next frame is drawn whole.
+  int compose(const std::vector<Hwc2Layer*>& layers,
+              buffer_handle_t& out,
+              RemoteDisplay::Damage& damage);
+  // signals when the last output has been read, the fence is taken
+  void setReleaseFence(int fence);
+  // frames were shown that weren't composed here, the next one is drawn
+  // and reported whole
+  void reset();
+  void releaseBuffers();
+
+ private:
+  // imported layer buffer
+  struct Source {
+    ~Source();
+    RemoteDisplay::BufferKey key;
+    buffer_handle_t handle = nullptr;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t stride = 0;  // in pixels
+    int32_t format = 0;
+  };
+  std::shared_ptr<Source> getSource(buffer_handle_t b);
+  bool acceptBuffer(Hwc2Layer& layer);
+  bool acceptLayer(Hwc2Layer& layer, uint64_t& area);
+  void addFrameDamage(const std::vector<Hwc2Layer*>& layers, rect_t& damage);
+  void drawColor(Hwc2Layer& layer,
+                 uint8_t* dst,
+                 uint32_t dstStride,
+                 const rect_t& r);
+  int drawLayer(Hwc2Layer& layer,
+                uint8_t* dst,
+                uint32_t dstStride,
+                const rect_t& region);
+
+ private:
+  // more overdraw than this many screens is left to the GPU
+  const uint32_t kMaxOverdraw = 3;
+  const size_t kMaxSources = 16;
+  // most recently used first
+  std::vector<std::shared_ptr<Source>> mSources;
+
+  // what the last output shows, to find what changed
+  struct LayerState {
+    uint64_t id;
+    uint32_t type;
+    rect_t dst;
+    rect_t crop;
+    int32_t blendMode;
+    float alpha;
+    uint32_t color;
+    uint32_t z;
+    buffer_handle_t buffer;
+    uint32_t bufferSeq;
+  };
+  std::vector<LayerState> mLastLayers;
+
+  struct Output {
+    buffer_handle_t handle = nullptr;
+    uint32_t stride = 0;  // in pixels
+    rect_t dirty = {0, 0, 0, 0};  // to redraw before it is shown again
+    int releaseFence = -1;
+  };
+  static const int kNumOutputs = 3;
+  Output mOutputs[kNumOutputs];
+  int mLastOutput = -1;
+  bool mFullDamage = true;
+  uint32_t mWidth = 0;
+  uint32_t mHeight = 0;
+
+  // a row of the current layer converted to RGBA
+  std::vector<uint8_t> mRow;
+};
+
+#endif  // __HWC2_COMPOSITOR_H__
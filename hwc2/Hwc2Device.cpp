@@ -65,7 +65,7 @@ Error Hwc2Device::init() {
   }
   mRemoteDisplayMgr->init(this);
   if (mRemoteDisplayMgr->connectToRemote() < 0) {
-    mDisplays.emplace(kPrimayDisplay, 0);
+    addDisplay(kPrimayDisplay);
     onHotplug(kPrimayDisplay, true);
   }
 
@@ -89,7 +89,7 @@ Error Hwc2Device::init() {
   }
 #endif
   for(int i = maxDisplayCount - 1; i >= 1 ; i--) {
-    mDisplays.emplace(i, i);
+    addDisplay(i);
     onHotplug(i, true);
   }
 #endif
@@ -97,6 +97,12 @@ Error Hwc2Device::init() {
   return Error::None;
 }
 
+Hwc2Display& Hwc2Device::addDisplay(hwc2_display_t id) {
+  auto it = mDisplays.emplace(id, id).first;
+  it->second.setVsyncListener(this);
+  return it->second;
+}
+
 int Hwc2Device::addRemoteDisplay(RemoteDisplay* rd) {
   if (!rd)
     return -1;
@@ -125,8 +131,7 @@ int Hwc2Device::addRemoteDisplay(RemoteDisplay* rd) {
     ALOGD("%s: add new display %" PRIu64, __func__, id);
 
     rd->setDisplayId(id);
-    mDisplays.emplace(id, id);
-    mDisplays.at(id).attach(rd);
+    addDisplay(id).attach(rd);
     onHotplug(id, true);
   }
   return 0;
@@ -150,7 +155,7 @@ int Hwc2Device::removeRemoteDisplay(RemoteDisplay* rd) {
       onHotplug(id, false);
       mDisplays.erase(id);
       if (mDisplays.empty()) {
-        mDisplays.emplace(kPrimayDisplay, 0);
+        addDisplay(kPrimayDisplay);
         onHotplug(kPrimayDisplay, true);
       }
     }
@@ -215,18 +220,46 @@ Error Hwc2Device::onRefresh(hwc2_display_t disp) {
   return Error::None;
 }
 
+void Hwc2Device::onVsync(hwc2_display_t disp,
+                         int64_t timestamp,
+                         uint32_t period) {
+  // SurfaceFlinger may register callbacks from within this one, call it
+  // without the lock
+  std::unique_lock<std::mutex> lk(mCallbackMutex);
+
+#ifdef SUPPORT_HWC_2_4
+  if (mCallbacks.count(HWC2_CALLBACK_VSYNC_2_4)) {
+    CallbackInfo cb = mCallbacks[HWC2_CALLBACK_VSYNC_2_4];
+    lk.unlock();
+    auto vsync = reinterpret_cast<HWC2_PFN_VSYNC_2_4>(cb.pointer);
+    vsync(cb.data, disp, timestamp, period);
+    return;
+  }
+#endif
+  if (mCallbacks.count(HWC2_CALLBACK_VSYNC)) {
+    CallbackInfo cb = mCallbacks[HWC2_CALLBACK_VSYNC];
+    lk.unlock();
+    auto vsync = reinterpret_cast<HWC2_PFN_VSYNC>(cb.pointer);
+    vsync(cb.data, disp, timestamp);
+  }
+}
+
 Error Hwc2Device::registerCallback(int32_t descriptor,
                                    hwc2_callback_data_t data,
                                    hwc2_function_pointer_t function) {
   ALOGV("%s:descriptor=%d", __func__, descriptor);
 
   auto desc = static_cast<hwc2_callback_descriptor_t>(descriptor);
-  if (function != nullptr) {
-    mCallbacks[desc] = {data, function};
-  } else {
-    ALOGI("unregisterCallback(%s)", getCallbackDescriptorName(desc));
-    mCallbacks.erase(desc);
-    return Error::None;
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mCallbackMutex);
+
+    if (function != nullptr) {
+      mCallbacks[desc] = {data, function};
+    } else {
+      ALOGI("unregisterCallback(%s)", getCallbackDescriptorName(desc));
+      mCallbacks.erase(desc);
+      return Error::None;
+    }
   }
 
   if (HWC2_CALLBACK_HOTPLUG == descriptor && !mPendingHotplugs.empty()) {
@@ -250,7 +283,20 @@ void Hwc2Device::getCapabilitiesHook(hwc2_device_t* dev,
                                      uint32_t* outCount,
                                      int32_t* outCap) {
   ALOGV("%s", __func__);
-  *outCount = 0;
+
+  // SurfaceFlinger presents first and validates only if present says so,
+  // saving a call per frame while the composition doesn't change
+  const int32_t caps[] = {HWC2_CAPABILITY_SKIP_VALIDATE};
+  const uint32_t numCaps = sizeof(caps) / sizeof(caps[0]);
+  if (!outCap) {
+    *outCount = numCaps;
+    return;
+  }
+  uint32_t n = 0;
+  for (; n < *outCount && n < numCaps; n++) {
+    outCap[n] = caps[n];
+  }
+  *outCount = n;
 }
 
 // static
@@ -37,7 +37,9 @@ Date: 2021.06.09
 #include "IRemoteDevice.h"
 #include "RemoteDisplayMgr.h"
 
-class Hwc2Device : public hwc2_device_t, public IRemoteDevice {
+class Hwc2Device : public hwc2_device_t,
+                   public IRemoteDevice,
+                   public VsyncListener {
  public:
   Hwc2Device();
   virtual ~Hwc2Device() {}
@@ -55,6 +57,9 @@ class Hwc2Device : public hwc2_device_t, public IRemoteDevice {
   HWC2::Error onHotplug(hwc2_display_t disp, bool connected);
   HWC2::Error onRefresh(hwc2_display_t disp);
 
+  // VsyncListener
+  void onVsync(hwc2_display_t disp, int64_t timestamp, uint32_t period) override;
+
   // IRemoteDevice
   int addRemoteDisplay(RemoteDisplay* rd) override;
   int removeRemoteDisplay(RemoteDisplay* rd) override;
@@ -130,6 +135,8 @@ class Hwc2Device : public hwc2_device_t, public IRemoteDevice {
                                hwc2_function_pointer_t function);
 
  private:
+  Hwc2Display& addDisplay(hwc2_display_t id);
+
   static std::atomic<hwc2_display_t> sNextId;
   const int kMaxDisplayCount = 100;
   const hwc2_display_t kPrimayDisplay = 0;
@@ -139,6 +146,8 @@ class Hwc2Device : public hwc2_device_t, public IRemoteDevice {
     hwc2_function_pointer_t pointer;
   };
   std::unordered_map<int32_t, CallbackInfo> mCallbacks;
+  // vsync callbacks come from the display vsync threads
+  std::mutex mCallbackMutex;
   std::vector<std::pair<hwc2_display_t, bool>> mPendingHotplugs;
 
   std::map<hwc2_display_t, Hwc2Display> mDisplays;
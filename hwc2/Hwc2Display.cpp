@@ -30,8 +30,11 @@ Date: 2021.06.09
 #include <errno.h>
 #include <inttypes.h>
 
+#include <algorithm>
+
 #include <cutils/log.h>
 #include <cutils/properties.h>
+#include <sync/sync.h>
 #include <unistd.h>
 
 #include "Hwc2Display.h"
@@ -44,6 +47,12 @@ Date: 2021.06.09
 
 using namespace HWC2;
 
+// a single empty rect means nothing changed, no rect means everything did
+static bool isDamageEmpty(const RemoteDisplay::Damage& damage) {
+  return damage.size() == 1 && (damage[0].right <= damage[0].left ||
+                                damage[0].bottom <= damage[0].top);
+}
+
 //#define DEBUG_LAYER
 #ifdef DEBUG_LAYER
 #define LAYER_TRACE(...) ALOGD(__VA_ARGS__)
@@ -72,6 +81,12 @@ Hwc2Display::Hwc2Display(hwc2_display_t id) {
     mWidth = w;
     mHeight = h;
   }
+  updateConfigs();
+
+  if (property_get("hwc_vhal.cpu_composition", value, nullptr) > 0 &&
+      atoi(value) > 0) {
+    mCompositor.reset(new Hwc2Compositor());
+  }
 
 #ifdef ENABLE_HWC_UIO
   mUioDisplay = new UioDisplay((int)id, mWidth, mHeight);
@@ -84,6 +99,8 @@ Hwc2Display::Hwc2Display(hwc2_display_t id) {
 
 Hwc2Display::~Hwc2Display() {
   ALOGD("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+  mVsyncThread.stop();
+  mIdleTimer.stop();
   if (mFbAcquireFenceFd >= 0) {
     close(mFbAcquireFenceFd);
     mFbAcquireFenceFd = -1;
@@ -92,6 +109,13 @@ Hwc2Display::~Hwc2Display() {
     close(mOutputBufferFenceFd);
     mOutputBufferFenceFd = -1;
   }
+  dropFences(mFrameSeq);
+  if (mAckedPresentFence >= 0) {
+    close(mAckedPresentFence);
+  }
+#ifdef ENABLE_HWC_UIO
+  delete mUioDisplay;
+#endif
 }
 
 int Hwc2Display::attach(RemoteDisplay* rd) {
@@ -104,13 +128,52 @@ int Hwc2Display::attach(RemoteDisplay* rd) {
   mWidth = mRemoteDisplay->width();
   mHeight = mRemoteDisplay->height();
   mFramerate = mRemoteDisplay->fps();
+  if (mFramerate > 0) {
+    mVsyncThread.setPeriod(1000 * 1000 * 1000 / mFramerate);
+  }
   mXDpi = mRemoteDisplay->xdpi();
   mYDpi = mRemoteDisplay->ydpi();
+  updateConfigs();
 
   display_flags flags;
   flags.value = mRemoteDisplay->flags();
   mVersion = flags.version;
   mMode = flags.mode;
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mFenceMutex);
+    mRemoteFences = flags.fences;
+    if (mRemoteFences && mTimeline.init() < 0) {
+      ALOGW("Hwc2Display(%" PRIu64
+            ") no sw_sync, fences of late acks can't be stood in for",
+            mDisplayID);
+    }
+  }
+  mMaxPlanes = rd->maxPlanes();
+  mPlanner.reset();
+  mGeometry++;
+
+  mFbtBuffers.setRemoteDisplay(rd);
+  mFbTargetId = mFbtBuffers.use(mFbTarget);
+  for (auto& layer : mLayers) {
+    layer.second.setRemoteDisplay(rd);
+  }
+
+  // acks of the frames carry their release and present fences
+  rd->setDisplayEventListener(this);
+  if (mVsyncEnabled) {
+    rd->setVsyncEnabled(true);
+  }
+
+  mForcePresent = true;
+  mIdle = false;
+  if (rd->idleHint()) {
+    uint32_t timeout = kDefaultIdleTimeoutMs;
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get("hwc_vhal.idle_timeout_ms", value, nullptr)) {
+      timeout = atoi(value);
+    }
+    mIdleTimer.start(timeout, [this]() { onIdle(); });
+  }
 
   ALOGD("Hwc2Display(%" PRIu64
         ")::%s w=%d,h=%d,fps=%d, xdpi=%d,ydpi=%d, protocal "
@@ -122,31 +185,225 @@ int Hwc2Display::attach(RemoteDisplay* rd) {
 
 int Hwc2Display::detach(RemoteDisplay* rd) {
   if (rd == mRemoteDisplay) {
-    mFbtBuffers.clear();
+    mIdleTimer.stop();
+    // the connection is gone, nothing to remove on the remote side
+    mFbtBuffers.setRemoteDisplay(nullptr);
+    mFbTargetId = 0;
+#ifdef ENABLE_HWC_UIO
+    if (mUioDisplay) {
+      mUioDisplay->releaseBuffers();
+    }
+#endif
+    if (mCompositor) {
+      mCompositor->releaseBuffers();
+      mCpuComposition = false;
+    }
+    for (auto& layer : mLayers) {
+      layer.second.setRemoteDisplay(nullptr);
+    }
+    mMaxPlanes = 0;
+    mClientTargetUsed = true;
+    mGeometry++;
     mTransform = 0;
+    rd->setDisplayEventListener(nullptr);
+    {  // lock scope
+      // no ack will come any more
+      std::unique_lock<std::mutex> lk(mFenceMutex);
+      setFramesAcked(mFrameSeq);
+      dropFences(mFrameSeq);
+      mReleasedFrame = mFrameSeq;
+      mRemoteFences = false;
+    }
     mRemoteDisplay = nullptr;
+    mVsyncThread.resetReference();
   }
   return 0;
 }
 
-int Hwc2Display::onBufferDisplayed(const buffer_info_t& info) {
-  ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+void Hwc2Display::updateConfigs() {
+  mConfigs.clear();
+  mConfig = 1;
+
+  if (mRemoteDisplay && !mRemoteDisplay->configs().empty()) {
+    for (auto& c : mRemoteDisplay->configs()) {
+      DisplayConfig config;
+      config.width = c.width;
+      config.height = c.height;
+      config.vsyncPeriod = 1000 * 1000 * 1000 / c.fps;
+      config.group = -1;
+      for (auto& other : mConfigs) {
+        if (other.width == config.width && other.height == config.height) {
+          config.group = other.group;
+          break;
+        }
+      }
+      if (config.group < 0) {
+        config.group = mConfigs.empty() ? 0 : mConfigs.back().group + 1;
+      }
+      mConfigs.push_back(config);
+    }
+    mConfig = mRemoteDisplay->activeConfig() + 1;
+    mFramerate = 1000 * 1000 * 1000 / mConfigs.at(mConfig - 1).vsyncPeriod;
+  } else {
+    mConfigs.push_back({mWidth, mHeight, 1000 * 1000 * 1000 / mFramerate, 0});
+  }
+}
+
+void Hwc2Display::switchConfig(hwc2_config_t config) {
+  ALOGD("Hwc2Display(%" PRIu64 ")::%s:config %u -> %u", mDisplayID, __func__,
+        mConfig, config);
+
+  auto& c = mConfigs.at(config - 1);
+  mForcePresent = true;
+  mConfig = config;
+  mWidth = c.width;
+  mHeight = c.height;
+  mFramerate = 1000 * 1000 * 1000 / c.vsyncPeriod;
+  if (mRemoteDisplay && !mRemoteDisplay->configs().empty()) {
+    mRemoteDisplay->setConfig(config - 1);
+  }
+}
+
+int Hwc2Display::onBufferDisplayed(uint32_t frame, const buffer_info_t& info) {
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:frame=%u", mDisplayID, __func__, frame);
 
   return 0;
 }
-int Hwc2Display::onPresented(std::vector<layer_buffer_info_t>& layerBuffer,
+
+int Hwc2Display::onPresented(uint32_t frame,
+                             std::vector<layer_buffer_info_t>& layerBuffer,
                              int& fence) {
-  ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:frame=%u", mDisplayID, __func__, frame);
+
+  std::unique_lock<std::mutex> lk(mFenceMutex);
+
+  // too late, fences on the timeline went out in their place
+  bool late = (int32_t)(frame - mReleasedFrame) <= 0;
+  for (auto& lb : layerBuffer) {
+    if (lb.fence < 0)
+      continue;
+    if (late) {
+      close(lb.fence);
+      continue;
+    }
+    auto& fences = mFrameReleaseFences[frame];
+    auto it = fences.find(lb.layerId);
+    if (it != fences.end()) {
+      close(it->second);
+      it->second = lb.fence;
+    } else {
+      fences.emplace(lb.layerId, lb.fence);
+    }
+  }
+  if (fence >= 0) {
+    if (mTimeline.valid()) {
+      close(fence);
+    } else {
+      if (mAckedPresentFence >= 0) {
+        close(mAckedPresentFence);
+      }
+      mAckedPresentFence = fence;
+    }
+    fence = -1;
+  }
+  return 0;
+}
 
-  display_flags flags;
-  flags.value = mRemoteDisplay->flags();
-  // mMode = flags.mode;
+int Hwc2Display::onFramesAcked(uint32_t frame) {
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:frame=%u", mDisplayID, __func__, frame);
 
+  std::unique_lock<std::mutex> lk(mFenceMutex);
+  setFramesAcked(frame);
   return 0;
 }
 
-Error Hwc2Display::vsync(int64_t timestamp) {
+void Hwc2Display::setFramesAcked(uint32_t frame) {
+  if ((int32_t)(frame - mAckedFrame) <= 0)
+    return;
+  mAckedFrame = frame;
+  mTimeline.signal(frame);
+}
+
+void Hwc2Display::dropFences(uint32_t frame) {
+  for (auto it = mFrameReleaseFences.begin();
+       it != mFrameReleaseFences.end() && (int32_t)(it->first - frame) <= 0;
+       it = mFrameReleaseFences.erase(it)) {
+    for (auto& f : it->second) {
+      close(f.second);
+    }
+  }
+  for (auto it = mFrameLayers.begin();
+       it != mFrameLayers.end() && (int32_t)(it->first - frame) <= 0;) {
+    it = mFrameLayers.erase(it);
+  }
+}
+
+int Hwc2Display::onVsync(int64_t timestamp, uint32_t period) {
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:timestamp=%" PRId64 " period=%u",
+        mDisplayID, __func__, timestamp, period);
+
+  mVsyncThread.addReference(timestamp, period);
+  return 0;
+}
+
+int Hwc2Display::updateFences(uint32_t prevFrame, int32_t* presentFence) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+
+  // The remote acks a frame after it has been presented, so the release
+  // fences returned now are the ones of the frame sent before this one: for
+  // the buffers this present replaces, as SurfaceFlinger expects.
+  std::unique_lock<std::mutex> lk(mFenceMutex);
+
+  *presentFence = -1;
+  if (!mRemoteFences)
+    return 0;
+
+  if (prevFrame && (int32_t)(prevFrame - mReleasedFrame) > 0) {
+    if ((int32_t)(prevFrame - mAckedFrame) <= 0) {
+      auto it = mFrameReleaseFences.find(prevFrame);
+      if (it != mFrameReleaseFences.end()) {
+        for (auto& f : it->second) {
+          auto layer = mLayers.find(f.first);
+          if (layer != mLayers.end()) {
+            layer->second.setReleaseFence(f.second);
+          } else {
+            close(f.second);
+          }
+        }
+        it->second.clear();
+      }
+    } else if (mTimeline.valid()) {
+      auto it = mFrameLayers.find(prevFrame);
+      if (it != mFrameLayers.end()) {
+        for (auto id : it->second) {
+          auto layer = mLayers.find(id);
+          if (layer != mLayers.end()) {
+            layer->second.setReleaseFence(mTimeline.createFence(prevFrame));
+          }
+        }
+      }
+    }
+    // fences of the frames before were never handed out, they are replaced
+    dropFences(prevFrame);
+    mReleasedFrame = prevFrame;
+  }
+
+  if (!mTimeline.valid()) {
+    *presentFence = mAckedPresentFence;
+    mAckedPresentFence = -1;
+  } else if ((int32_t)(mFrameSeq - mAckedFrame) > 0) {
+    *presentFence = mTimeline.createFence(mFrameSeq);
+  }
+  return 0;
+}
+
+Error Hwc2Display::vsync(int64_t timestamp, uint32_t period) {
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:timestamp=%" PRId64, mDisplayID,
+        __func__, timestamp);
+
+  if (mVsyncListener) {
+    mVsyncListener->onVsync(mDisplayID, timestamp, period);
+  }
   return Error::None;
 }
 Error Hwc2Display::refresh() {
@@ -163,6 +420,7 @@ Error Hwc2Display::acceptChanges() {
 
   for (auto& it : mLayers)
     it.second.acceptTypeChange();
+  mValidatedTypes = 0;
 
   return Error::None;
 }
@@ -178,6 +436,8 @@ Error Hwc2Display::createLayer(hwc2_layer_t* layer) {
   }
   mLayers.emplace(mLayerIndex, mLayerIndex);
   mLayers.at(mLayerIndex).setRemoteDisplay(mRemoteDisplay);
+  mLayers.at(mLayerIndex).setGeometryCounter(&mGeometry);
+  mGeometry++;
   *layer = mLayerIndex;
   mLayerIndex++;
   return Error::None;
@@ -192,7 +452,14 @@ Error Hwc2Display::destroyLayer(hwc2_layer_t layer) {
   if (mRemoteDisplay && mMode > 0) {
     mRemoteDisplay->removeLayer(layer);
   }
-  mLayers.erase(layer);
+  auto it = mLayers.find(layer);
+  if (it == mLayers.end()) {
+    return Error::BadLayer;
+  }
+  it->second.releaseBuffers();
+  mLayers.erase(it);
+  mGeometry++;
+  mForcePresent = true;
   return Error::None;
 }
 
@@ -261,21 +528,27 @@ Error Hwc2Display::getAttribute(hwc2_config_t config,
   ALOGV("Hwc2Display(%" PRIu64 ")::%s:config=%d,attribute=%d", mDisplayID,
         __func__, config, attribute);
 
-  if (config != mConfig || !value) {
+  if (config < 1 || config > mConfigs.size() || !value) {
     return Error::BadConfig;
   }
 
+  auto& c = mConfigs.at(config - 1);
   auto attr = static_cast<Attribute>(attribute);
   switch (attr) {
     case Attribute::Width:
-      *value = mWidth;
+      *value = c.width;
       break;
     case Attribute::Height:
-      *value = mHeight;
+      *value = c.height;
       break;
     case Attribute::VsyncPeriod:
-      *value = 1000 * 1000 * 1000 / mFramerate;
+      *value = c.vsyncPeriod;
+      break;
+#ifdef SUPPORT_HWC_2_4
+    case Attribute::ConfigGroup:
+      *value = c.group;
       break;
+#endif
     case Attribute::DpiX:
       *value = mXDpi * 1000;
       break;
@@ -292,10 +565,15 @@ Error Hwc2Display::getAttribute(hwc2_config_t config,
 Error Hwc2Display::getConfigs(uint32_t* num_configs, hwc2_config_t* configs) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
-  *num_configs = 1;
-  if (configs) {
-    configs[0] = mConfig;
+  if (!configs) {
+    *num_configs = mConfigs.size();
+    return Error::None;
+  }
+  uint32_t n = 0;
+  for (; n < *num_configs && n < mConfigs.size(); n++) {
+    configs[n] = n + 1;
   }
+  *num_configs = n;
   return Error::None;
 }
 
@@ -315,7 +593,18 @@ Error Hwc2Display::getRequests(int32_t* displayRequests,
                                int32_t* layerRequests) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
-  *numElements = 0;
+  *displayRequests = 0;
+  uint32_t numRequests = 0;
+  for (auto id : mClearLayers) {
+    if (layers && layerRequests && numRequests < *numElements) {
+      layers[numRequests] = id;
+      layerRequests[numRequests] = HWC2_LAYER_REQUEST_CLEAR_CLIENT_TARGET;
+    }
+    numRequests++;
+  }
+  if (!layers && !layerRequests) {
+    *numElements = numRequests;
+  }
   return Error::None;
 }
 
@@ -349,31 +638,171 @@ Error Hwc2Display::getReleaseFences(uint32_t* numElements,
                                     int32_t* fences) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
-  if (!layers || !fences) {
-    *numElements = mLayers.size();
-    return Error::None;
-  }
-
   uint32_t numLayers = 0;
   for (auto& l : mLayers) {
-    if (numLayers < *numElements) {
+    if (l.second.releaseFence() < 0)
+      continue;
+    if (layers && fences) {
+      if (numLayers >= *numElements)
+        break;
       layers[numLayers] = l.first;
-      fences[numLayers] = l.second.releaseFence();
-      numLayers++;
+      fences[numLayers] = l.second.takeReleaseFence();
     }
+    numLayers++;
   }
   *numElements = numLayers;
 
   return Error::None;
 }
 
+bool Hwc2Display::isStaticFrame(bool fbStatic) {
+  if (mForcePresent)
+    return false;
+
+  if ((mMode == 0 || mMode == 2) && !fbStatic)
+    return false;
+
+  if (mMode > 0) {
+    for (auto& layer : mLayers) {
+      if (layer.second.changed() || layer.second.bufferChanged())
+        return false;
+    }
+  }
+  return true;
+}
+
+void Hwc2Display::onIdle() {
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+
+  std::unique_lock<std::mutex> lk(mIdleMutex);
+
+  if (mRemoteDisplay && !mIdle) {
+    mRemoteDisplay->setIdle(true);
+    mIdle = true;
+  }
+}
+
+void Hwc2Display::getLayersByZ(std::vector<Hwc2Layer*>& layers) {
+  layers.clear();
+  for (auto& l : mLayers) {
+    layers.push_back(&l.second);
+  }
+  std::sort(layers.begin(), layers.end(), [](Hwc2Layer* a, Hwc2Layer* b) {
+    return a->info().z < b->info().z;
+  });
+}
+
+bool Hwc2Display::acceptCpuComposition() {
+  if (!mCompositor)
+    return false;
+  // the output goes where a client target would, a remote taking layers
+  // would take the layers left Device as planes too
+  bool fbConsumer = mRemoteDisplay && mMode == 0;
+#ifdef ENABLE_HWC_UIO
+  fbConsumer = fbConsumer || mUioDisplay;
+#endif
+  if (!fbConsumer)
+    return false;
+
+  std::vector<Hwc2Layer*> layers;
+  getLayersByZ(layers);
+  return mCompositor->accept(layers, mWidth, mHeight);
+}
+
+bool Hwc2Display::usePlanner() const {
+  bool planner = mRemoteDisplay && mMode == 2 && mMaxPlanes > 0;
+#ifdef ENABLE_HWC_UIO
+  planner = planner && !mUioDisplay;
+#endif
+  return planner;
+}
+
+bool Hwc2Display::keepsType(Hwc2Layer& layer) const {
+  if (mCpuComposition)
+    return true;
+  // a remote showing only layers draws solid colors from their color, rect
+  // and alpha. A mode 2 remote does so only if it advertises planes, any
+  // other one expects everything it doesn't get as layers in the client
+  // target.
+  return layer.type() == Composition::SolidColor && mRemoteDisplay &&
+         (mMode == 1 || usePlanner());
+}
+
+bool Hwc2Display::canReuseValidate() const {
+  // the cpu compositor and the planner look at the buffers as well
+  return mValidated && mValidatedGeometry == mGeometry && !mCompositor &&
+         !usePlanner();
+}
+
+int Hwc2Display::composeOnCpu() {
+  std::vector<Hwc2Layer*> layers;
+  getLayersByZ(layers);
+  buffer_handle_t out = nullptr;
+  if (mCompositor->compose(layers, out, mFbDamage) < 0 || !out) {
+    ALOGE("Hwc2Display(%" PRIu64 ") cpu composition of frame %d failed",
+          mDisplayID, mFrameNum);
+    return -1;
+  }
+
+  // composed synchronously, nothing to wait for
+  mFbTarget = out;
+  if (mFbAcquireFenceFd >= 0) {
+    close(mFbAcquireFenceFd);
+    mFbAcquireFenceFd = -1;
+  }
+  mFbDamageEmpty = isDamageEmpty(mFbDamage);
+  mFbTargetId = mFbtBuffers.use(mFbTarget);
+  return 0;
+}
+
 Error Hwc2Display::present(int32_t* retireFence) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
 
-  if (mRemoteDisplay) {
+  // SurfaceFlinger may skip validate, that holds only while the last one
+  // would give the same result without changes for it to take
+  if (!mFrameValidated && (!canReuseValidate() || mValidatedTypes > 0)) {
+    return Error::NotValidated;
+  }
+  mFrameValidated = false;
+
+  // a frame the cpu failed to compose isn't presented, the last one stays
+  bool cpuFailed = mCpuComposition && composeOnCpu() < 0;
+
+  // same client target without damage, nothing to send. An unused one is
+  // stale and isn't sent either.
+  bool fbStatic = cpuFailed || !mClientTargetUsed ||
+                  (!mForcePresent && mFbTarget == mLastFbTarget &&
+                   mFbDamageEmpty);
+  mLastFbTarget = mClientTargetUsed ? mFbTarget : nullptr;
+
+  // frame sent before this one, 0 if this one isn't sent
+  uint32_t prevFrame = 0;
+  if (mRemoteDisplay && isStaticFrame(fbStatic)) {
+    LAYER_TRACE("Hwc2Display(%" PRIu64 ") skip static frame %d", mDisplayID,
+                mFrameNum);
+    mSkippedFrames++;
+  } else if (mRemoteDisplay) {
+    // the remote may not have the previous frame, damage is then the whole
+    // buffer
+    bool fullDamage = mForcePresent;
+    uint32_t frame;
+    {  // lock scope
+      std::unique_lock<std::mutex> lk(mFenceMutex);
+      prevFrame = mFrameSeq;
+      frame = ++mFrameSeq;
+    }
+    mRemoteDisplay->beginFrame(frame);
+    {  // lock scope
+      std::unique_lock<std::mutex> lk(mIdleMutex);
+      if (mIdle) {
+        mRemoteDisplay->setIdle(false);
+        mIdle = false;
+      }
+    }
     if (mMode == 0 || mMode == 2) {
-      if (mFbTarget) {
-        mRemoteDisplay->displayBuffer(mFbTarget);
+      if (mFbTargetId && mClientTargetUsed) {
+        mRemoteDisplay->displayBuffer(mFbTargetId,
+                                      fullDamage ? nullptr : &mFbDamage);
         updateRotation();
       }
     }
@@ -390,25 +819,46 @@ Error Hwc2Display::present(int32_t* retireFence) {
       }
 
       std::vector<layer_buffer_info_t> layerBuffers;
+      std::vector<const RemoteDisplay::Damage*> layerDamage;
       for (auto& layer : mLayers) {
         if (layer.second.bufferChanged()) {
           layerBuffers.push_back(layer.second.layerBuffer());
+          layerDamage.push_back(fullDamage ? nullptr : &layer.second.damage());
         }
       }
       if (layerBuffers.size()) {
-        mRemoteDisplay->presentLayers(layerBuffers);
+        std::unique_lock<std::mutex> lk(mFenceMutex);
+        if (mRemoteFences && mTimeline.valid()) {
+          auto& ids = mFrameLayers[frame];
+          for (auto& lb : layerBuffers) {
+            ids.push_back(lb.layerId);
+          }
+        }
+        lk.unlock();
+        mRemoteDisplay->presentLayers(layerBuffers, layerDamage);
       }
       for (auto& layer : mLayers) {
         layer.second.setUnchanged();
       }
     }
+    mRemoteDisplay->commitFrame();
+    mIdleTimer.reset();
+
+    // a frame without requests to ack is done once those before it are
+    std::unique_lock<std::mutex> lk(mFenceMutex);
+    setFramesAcked(mRemoteDisplay->ackedFrame());
   }
 
+  int copyFence = -1;
 #ifdef ENABLE_HWC_UIO
-  if (mUioDisplay && mFbTarget) {
-    mUioDisplay->postFb(mFbTarget);
+  if (mUioDisplay && mFbTarget && !fbStatic) {
+    int acquireFence = mFbAcquireFenceFd >= 0 ? dup(mFbAcquireFenceFd) : -1;
+    mUioDisplay->postFb(mFbTarget, mForcePresent ? nullptr : &mFbDamage,
+                        acquireFence, &copyFence);
   }
 #endif
+  // every consumer has the whole frame now
+  mForcePresent = false;
 
 #ifdef ENABLE_LAYER_DUMP
   dump();
@@ -430,14 +880,37 @@ Error Hwc2Display::present(int32_t* retireFence) {
 #endif
 
   mFrameNum++;
-  *retireFence = -1;
+  updateFences(prevFrame, retireFence);
+  if (copyFence >= 0) {
+    // the client target is released once the copy is done
+    if (*retireFence >= 0) {
+      int merged = sync_merge("hwc_vhal_present", *retireFence, copyFence);
+      close(*retireFence);
+      close(copyFence);
+      *retireFence = merged;
+    } else {
+      *retireFence = copyFence;
+    }
+  }
+  if (mCpuComposition && !cpuFailed && *retireFence >= 0) {
+    // the output is read by the remote and the uio copy until then, it
+    // mustn't be drawn again before
+    mCompositor->setReleaseFence(dup(*retireFence));
+  }
   return Error::None;
 }
 
 Error Hwc2Display::setActiveConfig(hwc2_config_t config) {
-  ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:config=%u", mDisplayID, __func__,
+        config);
 
-  mConfig = config;
+  if (config < 1 || config > mConfigs.size()) {
+    return Error::BadConfig;
+  }
+  if (config != mConfig) {
+    mVsyncThread.changePeriod(mConfigs.at(config - 1).vsyncPeriod, 0);
+    switchConfig(config);
+  }
   return Error::None;
 }
 
@@ -452,20 +925,10 @@ Error Hwc2Display::setClientTarget(buffer_handle_t target,
     close(mFbAcquireFenceFd);
   }
   mFbAcquireFenceFd = acquireFence;
+  RemoteDisplay::getDamage(damage, mFbDamage);
+  mFbDamageEmpty = isDamageEmpty(mFbDamage);
 
-  if (mRemoteDisplay) {
-    bool isNew = true;
-
-    for (auto fbt : mFbtBuffers) {
-      if (fbt == mFbTarget) {
-        isNew = false;
-      }
-    }
-    if (isNew) {
-      mFbtBuffers.push_back(mFbTarget);
-      mRemoteDisplay->createBuffer(mFbTarget);
-    }
-  }
+  mFbTargetId = mFbtBuffers.use(mFbTarget);
   return Error::None;
 }
 
@@ -502,7 +965,30 @@ Error Hwc2Display::setPowerMode(int32_t mode) {
 }
 
 Error Hwc2Display::setVsyncEnabled(int32_t enabled) {
-  ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:enabled=%d", mDisplayID, __func__,
+        enabled);
+
+  auto mode = static_cast<Vsync>(enabled);
+  if (mode != Vsync::Enable && mode != Vsync::Disable) {
+    return Error::BadParameter;
+  }
+
+  bool enable = mode == Vsync::Enable;
+  if (enable && !mVsyncThread.started()) {
+    if (mVsyncThread.start([this](int64_t timestamp, uint32_t period) {
+          vsync(timestamp, period);
+        }) < 0) {
+      return Error::NoResources;
+    }
+  }
+  mVsyncThread.setEnabled(enable);
+
+  if (mVsyncEnabled != enable) {
+    mVsyncEnabled = enable;
+    if (mRemoteDisplay) {
+      mRemoteDisplay->setVsyncEnabled(enable);
+    }
+  }
   return Error::None;
 }
 
@@ -511,16 +997,43 @@ Error Hwc2Display::validate(uint32_t* numTypes, uint32_t* numRequests) {
 
   *numTypes = 0;
   *numRequests = 0;
+  mFrameValidated = true;
 
-  for (auto& l : mLayers) {
-    Hwc2Layer& layer = l.second;
+  // nothing changed, the layers keep their validated types
+  if (canReuseValidate()) {
+    *numTypes = mValidatedTypes;
+    return *numTypes > 0 ? Error::HasChanges : Error::None;
+  }
+
+  mCpuComposition = acceptCpuComposition();
+  if (mCompositor && !mCpuComposition) {
+    // the frames in between aren't drawn by it
+    mCompositor->reset();
+  }
+  mClearLayers.clear();
+
+  std::vector<Hwc2Layer*> layers;
+  getLayersByZ(layers);
+  std::vector<bool> planes;
+  bool planner = usePlanner();
+  if (planner) {
+    mPlanner.plan(layers, mMaxPlanes, mWidth, mHeight, planes);
+  }
+
+  size_t lowestClient = layers.size();
+  for (size_t i = 0; i < layers.size(); i++) {
+    Hwc2Layer& layer = *layers[i];
     switch (layer.type()) {
       case Composition::Device:
+      case Composition::Cursor:
+      case Composition::SolidColor:
+        if (planner ? planes[i] : keepsType(layer)) {
+          layer.setValidatedType(layer.type());
+          break;
+        }
         layer.setValidatedType(Composition::Client);
         ++*numTypes;
         break;
-      case Composition::SolidColor:
-      case Composition::Cursor:
       case Composition::Sideband:
         layer.setValidatedType(Composition::Client);
         ++*numTypes;
@@ -529,13 +1042,28 @@ Error Hwc2Display::validate(uint32_t* numTypes, uint32_t* numRequests) {
         layer.setValidatedType(layer.type());
         break;
     }
+    if (layer.validatedType() == Composition::Client && i < lowestClient) {
+      lowestClient = i;
+    }
+  }
+
+  // the planes below the client target show through it
+  mClientTargetUsed = !planner || lowestClient < layers.size();
+  if (planner && mClientTargetUsed) {
+    for (size_t i = 0; i < lowestClient; i++) {
+      mClearLayers.push_back(layers[i]->info().layerId);
+    }
+    *numRequests = mClearLayers.size();
   }
 #ifdef ENABLE_HWC_UIO
   checkRotation();
 #endif
+  mValidated = true;
+  mValidatedGeometry = mGeometry;
+  mValidatedTypes = *numTypes;
 
   // dump();
-  return *numTypes > 0 ? Error::HasChanges : Error::None;
+  return *numTypes > 0 || *numRequests > 0 ? Error::HasChanges : Error::None;
 }
 
 Error Hwc2Display::setBrightness(float brightness) {
@@ -612,8 +1140,9 @@ int Hwc2Display::updateRotation() {
 }
 
 void Hwc2Display::dump() {
-  ALOGD("-----Dump of Display(%" PRIu64 "): frame=%d remote=%p, mode=%d-----",
-        mDisplayID, mFrameNum, mRemoteDisplay, mMode);
+  ALOGD("-----Dump of Display(%" PRIu64
+        "): frame=%d skipped=%d remote=%p, mode=%d-----",
+        mDisplayID, mFrameNum, mSkippedFrames, mRemoteDisplay, mMode);
   for (auto& l : mLayers) {
     l.second.dump();
   }
@@ -621,13 +1150,39 @@ void Hwc2Display::dump() {
 
 Error Hwc2Display::getVsyncPeriod(hwc2_vsync_period_t* period) {
   ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
-  *period = 1000 * 1000 * 1000 / mFramerate;
+  *period = mVsyncThread.period();
   return Error::None;
 }
 
 Error Hwc2Display::setActiveConfigWithConstraints(hwc2_config_t config,
                        hwc_vsync_period_change_constraints_t* constraints,
                        hwc_vsync_period_change_timeline_t* timeline_t) {
-  ALOGV("Hwc2Display(%" PRIu64 ")::%s", mDisplayID, __func__);
+  ALOGV("Hwc2Display(%" PRIu64 ")::%s:config=%u", mDisplayID, __func__,
+        config);
+
+  if (!constraints || !timeline_t) {
+    return Error::BadParameter;
+  }
+  if (config < 1 || config > mConfigs.size()) {
+    return Error::BadConfig;
+  }
+
+  auto& next = mConfigs.at(config - 1);
+  auto& cur = mConfigs.at(mConfig - 1);
+  // only the rate can change without a modeset: a new size needs new buffers
+  bool seamless = next.group == cur.group;
+  if (constraints->seamlessRequired && !seamless) {
+    return Error::SeamlessNotAllowed;
+  }
+
+  int64_t applied =
+      mVsyncThread.changePeriod(next.vsyncPeriod, constraints->desiredTimeNanos);
+  timeline_t->newVsyncAppliedTimeNanos = applied;
+  timeline_t->refreshRequired = !seamless;
+  timeline_t->refreshTimeNanos = applied - next.vsyncPeriod;
+
+  if (config != mConfig) {
+    switchConfig(config);
+  }
   return Error::None;
 }
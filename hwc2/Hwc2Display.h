@@ -30,19 +30,31 @@ Date: 2021.06.09
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <hardware/hwcomposer2.h>
 
+#include "Hwc2Compositor.h"
 #include "Hwc2Layer.h"
+#include "Hwc2Planner.h"
 #include "IRemoteDevice.h"
+#include "IdleTimer.h"
+#include "RemoteDisplay.h"
+#include "SyncTimeline.h"
+#include "VsyncThread.h"
 #include "display_protocol.h"
 
 #ifdef ENABLE_HWC_UIO
 #include "UioDisplay.h"
 #endif
 
-class RemoteDisplay;
+struct VsyncListener {
+  virtual ~VsyncListener(){};
+  virtual void onVsync(hwc2_display_t disp,
+                       int64_t timestamp,
+                       uint32_t period) = 0;
+};
 
 class Hwc2Display : public DisplayEventListener {
  public:
@@ -54,11 +66,15 @@ class Hwc2Display : public DisplayEventListener {
   bool attachable() const { return !mRemoteDisplay; }
   int attach(RemoteDisplay* rd);
   int detach(RemoteDisplay* rd);
+  void setVsyncListener(VsyncListener* listener) { mVsyncListener = listener; }
 
   // DisplayEventListener
-  int onBufferDisplayed(const buffer_info_t& info) override;
-  int onPresented(std::vector<layer_buffer_info_t>& layerBuffer,
+  int onBufferDisplayed(uint32_t frame, const buffer_info_t& info) override;
+  int onPresented(uint32_t frame,
+                  std::vector<layer_buffer_info_t>& layerBuffer,
                   int& fence) override;
+  int onFramesAcked(uint32_t frame) override;
+  int onVsync(int64_t timestamp, uint32_t period) override;
 
   hwc2_display_t getDisplayID() const { return mDisplayID; }
   Hwc2Layer& getLayer(hwc2_layer_t l) { return mLayers.at(l); }
@@ -119,9 +135,22 @@ class Hwc2Display : public DisplayEventListener {
 
  protected:
   HWC2::Error hotplug(bool in);
-  HWC2::Error vsync(int64_t timestamp);
+  HWC2::Error vsync(int64_t timestamp, uint32_t period);
   HWC2::Error refresh();
   int updateRotation();
+  int updateFences(uint32_t prevFrame, int32_t* presentFence);
+  void setFramesAcked(uint32_t frame);
+  void dropFences(uint32_t frame);
+  void updateConfigs();
+  bool isStaticFrame(bool fbStatic);
+  void onIdle();
+  void switchConfig(hwc2_config_t config);
+  void getLayersByZ(std::vector<Hwc2Layer*>& layers);
+  bool acceptCpuComposition();
+  bool usePlanner() const;
+  bool keepsType(Hwc2Layer& layer) const;
+  bool canReuseValidate() const;
+  int composeOnCpu();
 #ifdef ENABLE_HWC_UIO
   int checkRotation();
 #endif
@@ -133,6 +162,23 @@ class Hwc2Display : public DisplayEventListener {
   std::map<hwc2_layer_t, Hwc2Layer> mLayers;
   hwc2_layer_t mLayerIndex = 0;
 
+  // Bumped by the layers and on layer or remote changes. Validate is done
+  // again only if it moved since the last one.
+  uint32_t mGeometry = 0;
+  uint32_t mValidatedGeometry = 0;
+  bool mValidated = false;
+  uint32_t mValidatedTypes = 0;
+  // validate ran for the frame being presented
+  bool mFrameValidated = false;
+
+  // config ids are indexes in mConfigs + 1, configs of one size share a group
+  struct DisplayConfig {
+    int32_t width;
+    int32_t height;
+    int32_t vsyncPeriod;
+    int32_t group;
+  };
+  std::vector<DisplayConfig> mConfigs;
   uint32_t mConfig = 1;
   int32_t mWidth = 1280;
   int32_t mHeight = 720;
@@ -143,7 +189,26 @@ class Hwc2Display : public DisplayEventListener {
 
   buffer_handle_t mFbTarget = nullptr;
   int mFbAcquireFenceFd = -1;
-  std::vector<buffer_handle_t> mFbtBuffers;
+  RemoteDisplay::Damage mFbDamage;
+  bool mFbDamageEmpty = false;
+  // client target of the last present
+  buffer_handle_t mLastFbTarget = nullptr;
+  const size_t kMaxFbtBuffers = 4;
+  RemoteBufferSet mFbtBuffers{kMaxFbtBuffers};
+  uint64_t mFbTargetId = 0;
+
+  // With hwc_vhal.cpu_composition set, frames of simple layers are composed
+  // here and the output replaces the client target.
+  std::unique_ptr<Hwc2Compositor> mCompositor;
+  bool mCpuComposition = false;
+
+  // In mode 2 with a plane budget from the remote, the layers it composes
+  // itself. The others go to the client target, cleared under the planes
+  // below it.
+  Hwc2Planner mPlanner;
+  uint32_t mMaxPlanes = 0;
+  std::vector<hwc2_layer_t> mClearLayers;
+  bool mClientTargetUsed = true;
 
   buffer_handle_t mOutputBuffer = nullptr;
   int mOutputBufferFenceFd = -1;
@@ -154,9 +219,39 @@ class Hwc2Display : public DisplayEventListener {
   RemoteDisplay* mRemoteDisplay = nullptr;
   uint32_t mVersion = 0;
   uint32_t mMode = 0;
-  int mReleaseFence = -1;
+
+  // With remote fences, frames sent are numbered from 1 and the fences of
+  // each ack handed to SurfaceFlinger for the frame they belong to. Fences
+  // on mTimeline stand in for those of frames not acked yet.
+  std::mutex mFenceMutex;
+  bool mRemoteFences = false;
+  SyncTimeline mTimeline;
+  uint32_t mFrameSeq = 0;
+  uint32_t mAckedFrame = 0;
+  // release fences were handed out up to this frame
+  uint32_t mReleasedFrame = 0;
+  // release fences of acked frames and layers sent in the others, by frame
+  std::map<uint32_t, std::map<uint64_t, int>> mFrameReleaseFences;
+  std::map<uint32_t, std::vector<uint64_t>> mFrameLayers;
+  // without sw_sync, the present fence of the last ack
+  int mAckedPresentFence = -1;
 
   int mFrameNum = 0;
+  int mSkippedFrames = 0;
+  // set when the remote must get a frame even if nothing seems to change
+  bool mForcePresent = true;
+
+  // the remote is told the display is static after a while without frames
+  const uint32_t kDefaultIdleTimeoutMs = 500;
+  IdleTimer mIdleTimer;
+  std::mutex mIdleMutex;
+  bool mIdle = false;
+
+  // software vsync, locked to the remote vsync events if it sends them. The
+  // thread is started on first enable.
+  VsyncListener* mVsyncListener = nullptr;
+  VsyncThread mVsyncThread;
+  bool mVsyncEnabled = false;
 
 #ifdef ENABLE_LAYER_DUMP
   int mFrameToDump = 0;
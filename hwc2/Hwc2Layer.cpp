@@ -41,22 +41,39 @@ Hwc2Layer::Hwc2Layer(hwc2_layer_t idx) {
   mLayerID = idx;
   memset(&mInfo, 0, sizeof(mInfo));
   mInfo.layerId = idx;
-  mInfo.changed = true;
+  mInfo.changed = LAYER_FIELD_ALL;
   memset(&mLayerBuffer, 0, sizeof(layer_buffer_info_t));
   mLayerBuffer.layerId = idx;
 }
 
 Hwc2Layer::~Hwc2Layer() {
-  // since connection is broken, we can't ask remote to remove buffers
-  //if (mRemoteDisplay) {
-  //  for (auto buffer : mBuffers) {
-  //    mRemoteDisplay->removeBuffer(buffer);
-  //  }
-  //}
   if (mAcquireFence >= 0) {
     close(mAcquireFence);
     mAcquireFence = -1;
   }
+  if (mReleaseFence >= 0) {
+    close(mReleaseFence);
+    mReleaseFence = -1;
+  }
+}
+
+void Hwc2Layer::setReleaseFence(int fence) {
+  if (mReleaseFence >= 0) {
+    close(mReleaseFence);
+  }
+  mReleaseFence = fence;
+}
+
+void Hwc2Layer::setRemoteDisplay(RemoteDisplay* disp) {
+  if (disp == mRemoteDisplay)
+    return;
+
+  mRemoteDisplay = disp;
+  mBuffers.setRemoteDisplay(disp);
+  // a new remote knows nothing about this layer yet
+  mLayerBuffer.bufferId = mBuffers.use(mBuffer);
+  mLayerBuffer.changed = mBuffer != nullptr;
+  mInfo.changed = LAYER_FIELD_ALL;
 }
 
 Error Hwc2Layer::setCursorPosition(int32_t /*x*/, int32_t /*y*/) {
@@ -68,7 +85,8 @@ Error Hwc2Layer::setBlendMode(int32_t mode) {
   ALOGV("%s", __func__);
   if (mInfo.blendMode != mode) {
     mInfo.blendMode = mode;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_FIELD_BLEND_MODE;
+    geometryChanged();
   }
   return Error::None;
 }
@@ -76,36 +94,37 @@ Error Hwc2Layer::setBlendMode(int32_t mode) {
 Error Hwc2Layer::setBuffer(buffer_handle_t buffer, int32_t acquireFence) {
   ALOGV("%s", __func__);
 
+  // kept until the next buffer, the remote gets its own copy in present
   if (mAcquireFence >= 0) {
     close(mAcquireFence);
   }
   mAcquireFence = acquireFence;
+  mLayerBuffer.fence = acquireFence;
 
   if (mBuffer != buffer) {
-    if (mBuffers.count(buffer) == 0) {
-      mBuffers.insert(buffer);
-      if (mRemoteDisplay) {
-        mRemoteDisplay->createBuffer(buffer);
-      }
+    // only whether there is one matters to validate
+    if (!mBuffer != !buffer) {
+      geometryChanged();
     }
-
     mBuffer = buffer;
-    mAcquireFence = acquireFence;
-    mLayerBuffer.bufferId = (uint64_t)mBuffer;
-    mLayerBuffer.fence = acquireFence;
+    mLayerBuffer.bufferId = mBuffers.use(buffer);
     mLayerBuffer.changed = true;
+    mBufferSeq++;
+  } else if (acquireFence >= 0) {
+    // same buffer with new content
+    mLayerBuffer.changed = true;
+    mBufferSeq++;
   }
   return Error::None;
 }
 
 Error Hwc2Layer::setColor(hwc_color_t color) {
   ALOGV("%s", __func__);
-  // We only support Opaque colors so far.
   if ((mColor.r != color.r) || (mColor.g != color.g) || (mColor.b != color.b) ||
       (mColor.a != color.a)) {
     mColor = color;
-    mInfo.color = color.r | (color.g << 8) | (color.g << 16) | (color.a << 24);
-    mInfo.changed = true;
+    mInfo.color = color.r | (color.g << 8) | (color.b << 16) | (color.a << 24);
+    mInfo.changed |= LAYER_FIELD_COLOR;
   }
 
   return Error::None;
@@ -114,10 +133,22 @@ Error Hwc2Layer::setColor(hwc_color_t color) {
 Error Hwc2Layer::setCompositionType(int32_t type) {
   ALOGV("%s", __func__);
 
-  mType = static_cast<Composition>(type);
+  if (mType != static_cast<Composition>(type)) {
+    geometryChanged();
+  }
+  updateType(static_cast<Composition>(type));
   return Error::None;
 }
 
+// the remote composes solid color layers itself from their color
+void Hwc2Layer::updateType(Composition type) {
+  mType = type;
+  if (mInfo.type != static_cast<uint32_t>(type)) {
+    mInfo.type = static_cast<uint32_t>(type);
+    mInfo.changed |= LAYER_FIELD_TYPE;
+  }
+}
+
 Error Hwc2Layer::setDataspace(int32_t dataspace) {
   ALOGV("%s", __func__);
 
@@ -136,7 +167,8 @@ Error Hwc2Layer::setDisplayFrame(hwc_rect_t frame) {
     mInfo.dstFrame.top = mDstFrame.top;
     mInfo.dstFrame.right = mDstFrame.right;
     mInfo.dstFrame.bottom = mDstFrame.bottom;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_FIELD_DST_FRAME;
+    geometryChanged();
   }
   return Error::None;
 }
@@ -148,7 +180,8 @@ Error Hwc2Layer::setPlaneAlpha(float alpha) {
     mAlpha = alpha;
 
     mInfo.planeAlpha = alpha;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_FIELD_PLANE_ALPHA;
+    geometryChanged();
   }
   return Error::None;
 }
@@ -169,7 +202,8 @@ Error Hwc2Layer::setSourceCrop(hwc_frect_t crop) {
     mInfo.srcCrop.top = (int)mSrcCrop.top;
     mInfo.srcCrop.right = (int)mSrcCrop.right;
     mInfo.srcCrop.bottom = (int)mSrcCrop.bottom;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_FIELD_SRC_CROP;
+    geometryChanged();
   }
   return Error::None;
 }
@@ -177,7 +211,8 @@ Error Hwc2Layer::setSourceCrop(hwc_frect_t crop) {
 Error Hwc2Layer::setSurfaceDamage(hwc_region_t damage) {
   ALOGV("%s", __func__);
 
-  mDamage = damage;
+  // the region only lives for the call
+  RemoteDisplay::getDamage(damage, mDamage);
   return Error::None;
 }
 
@@ -188,7 +223,8 @@ Error Hwc2Layer::setTransform(int32_t transform) {
     mTransform = transform;
 
     mInfo.transform = transform;
-    mInfo.changed = true;
+    mInfo.changed |= LAYER_FIELD_TRANSFORM;
+    geometryChanged();
   }
   return Error::None;
 }
@@ -203,8 +239,13 @@ Error Hwc2Layer::setVisibleRegion(hwc_region_t visible) {
 Error Hwc2Layer::setZOrder(uint32_t order) {
   ALOGV("%s", __func__);
 
-  mZOrder = order;
-  mInfo.z = order;
+  if (mZOrder != order) {
+    mZOrder = order;
+
+    mInfo.z = order;
+    mInfo.changed |= LAYER_FIELD_Z;
+    geometryChanged();
+  }
   return Error::None;
 }
 
@@ -213,6 +254,10 @@ HWC2::Error Hwc2Layer::setTaskInfo(uint32_t stackId,
                                    uint32_t taskId,
                                    uint32_t userId,
                                    uint32_t index) {
+  if (mStackId == stackId && mTaskId == taskId && mUserId == userId &&
+      mIndex == index) {
+    return Error::None;
+  }
   mStackId = stackId;
   mTaskId = taskId;
   mUserId = userId;
@@ -222,6 +267,7 @@ HWC2::Error Hwc2Layer::setTaskInfo(uint32_t stackId,
   mInfo.taskId = taskId;
   mInfo.userId = userId;
   mInfo.index = index;
+  mInfo.changed |= LAYER_FIELD_TASK_INFO;
   return Error::None;
 }
 #endif
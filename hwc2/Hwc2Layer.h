@@ -28,27 +28,44 @@ Date: 2021.06.09
 #include "RemoteDisplay.h"
 #include "display_protocol.h"
 
-#include <set>
-
 class Hwc2Layer {
  public:
   Hwc2Layer(hwc2_layer_t idx);
   ~Hwc2Layer();
 
-  void setRemoteDisplay(RemoteDisplay* disp) { mRemoteDisplay = disp; }
+  void setRemoteDisplay(RemoteDisplay* disp);
+  // bumped whenever something validate looks at changes
+  void setGeometryCounter(uint32_t* counter) { mGeometryCounter = counter; }
+  void releaseBuffers() { mBuffers.clear(); }
   HWC2::Composition type() const { return mType; }
   void setValidatedType(HWC2::Composition t) { mValidatedType = t; }
   HWC2::Composition validatedType() const { return mValidatedType; }
   bool typeChanged() const { return mValidatedType != mType; }
-  void acceptTypeChange() { mType = mValidatedType; }
+  void acceptTypeChange() { updateType(mValidatedType); }
 
   int releaseFence() const { return mReleaseFence; }
-  bool changed() const { return mInfo.changed; }
+  // the caller owns the returned fence
+  int takeReleaseFence() {
+    int fence = mReleaseFence;
+    mReleaseFence = -1;
+    return fence;
+  }
+  void setReleaseFence(int fence);
+  bool changed() const { return mInfo.changed != 0; }
   layer_info_t& info() { return mInfo; }
   bool bufferChanged() const { return mLayerBuffer.changed; }
   layer_buffer_info_t& layerBuffer() { return mLayerBuffer; }
+  const RemoteDisplay::Damage& damage() const { return mDamage; }
+  buffer_handle_t buffer() const { return mBuffer; }
+  // owned by the layer
+  int acquireFence() const { return mAcquireFence; }
+  const hwc_frect_t& sourceCrop() const { return mSrcCrop; }
+  // as an RGBA pixel, little endian
+  uint32_t color() const { return mInfo.color; }
+  // bumped whenever the buffer or its content changes
+  uint32_t bufferSeq() const { return mBufferSeq; }
   void setUnchanged() {
-    mInfo.changed = false;
+    mInfo.changed = 0;
     mLayerBuffer.changed = false;
   }
   void dump();
@@ -75,20 +92,30 @@ class Hwc2Layer {
                           uint32_t index);
 #endif
 
+ private:
+  void updateType(HWC2::Composition type);
+  void geometryChanged() {
+    if (mGeometryCounter)
+      ++*mGeometryCounter;
+  }
+
  private:
   hwc2_layer_t mLayerID = 0;
   HWC2::Composition mType = HWC2::Composition::Invalid;
   HWC2::Composition mValidatedType = HWC2::Composition::Invalid;
   int mReleaseFence = -1;
 
-  std::set<buffer_handle_t> mBuffers;
+  // enough for the deepest BufferQueue SurfaceFlinger normally uses
+  const size_t kMaxBuffers = 8;
+  RemoteBufferSet mBuffers{kMaxBuffers};
   buffer_handle_t mBuffer = nullptr;
   int mAcquireFence = -1;
+  uint32_t mBufferSeq = 0;
 
   int32_t mDataspace = 0;
   hwc_rect_t mDstFrame;
   hwc_frect_t mSrcCrop;
-  hwc_region_t mDamage;
+  RemoteDisplay::Damage mDamage;
   hwc_region_t mVisibleRegion;
 
   hwc_color_t mColor = {.r = 0, .g = 0, .b = 0, .a = 0};
@@ -102,6 +129,7 @@ class Hwc2Layer {
   uint32_t mIndex = 0;
 
   RemoteDisplay* mRemoteDisplay = nullptr;
+  uint32_t* mGeometryCounter = nullptr;
   layer_info_t mInfo;
   layer_buffer_info_t mLayerBuffer;
 };
@@ -0,0 +1,126 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+
+#include <algorithm>
+
+#include "Hwc2Planner.h"
+
+using namespace HWC2;
+
+bool Hwc2Planner::eligible(Hwc2Layer& layer) const {
+  switch (layer.type()) {
+    case Composition::Device:
+    case Composition::Cursor:
+      return layer.buffer() != nullptr;
+    case Composition::SolidColor:
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint64_t Hwc2Planner::score(Hwc2Layer& layer,
+                            uint32_t width,
+                            uint32_t height) {
+  bool known = mStats.count(layer.info().layerId) > 0;
+  LayerStats& stats = mStats[layer.info().layerId];
+  bool updated = known && layer.bufferSeq() != stats.bufferSeq;
+  stats.rate = stats.rate - stats.rate / 8 + (updated ? kRateOne / 8 : 0);
+  stats.bufferSeq = layer.bufferSeq();
+  stats.seen = true;
+
+  const rect_t& d = layer.info().dstFrame;
+  int w = std::min(d.right, (int)width) - std::max(d.left, 0);
+  int h = std::min(d.bottom, (int)height) - std::max(d.top, 0);
+  if (w <= 0 || h <= 0)
+    return 0;
+
+  // a layer redrawn every frame counts four times its area
+  uint64_t area = (uint64_t)w * h;
+  uint64_t s = area + area * 3 * stats.rate / kRateOne;
+  if (stats.plane) {
+    s += s / 4;
+  }
+  return s;
+}
+
+void Hwc2Planner::plan(const std::vector<Hwc2Layer*>& layers,
+                       uint32_t maxPlanes,
+                       uint32_t width,
+                       uint32_t height,
+                       std::vector<bool>& planes) {
+  size_t n = layers.size();
+  planes.assign(n, false);
+
+  for (auto& s : mStats) {
+    s.second.seen = false;
+  }
+  std::vector<uint64_t> scores(n);
+  for (size_t i = 0; i < n; i++) {
+    scores[i] = score(*layers[i], width, height);
+  }
+  for (auto it = mStats.begin(); it != mStats.end();) {
+    if (!it->second.seen) {
+      it = mStats.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // runs of eligible layers from the bottom and from the top
+  size_t bottom = 0;
+  while (bottom < n && bottom < maxPlanes && eligible(*layers[bottom]))
+    bottom++;
+  size_t top = 0;
+  while (top < n && top < maxPlanes && eligible(*layers[n - 1 - top]))
+    top++;
+
+  // the best split of the budget between the bottom and the top, layers
+  // off screen score nothing and don't matter either way
+  size_t bestBottom = 0, bestTop = 0;
+  uint64_t best = 0;
+  uint64_t bottomScore = 0;
+  for (size_t b = 0; b <= bottom; b++) {
+    if (b > 0) {
+      bottomScore += scores[b - 1];
+    }
+    size_t t = std::min(top, std::min(maxPlanes - b, n - b));
+    uint64_t total = bottomScore;
+    for (size_t i = 0; i < t; i++) {
+      total += scores[n - 1 - i];
+    }
+    if (total > best) {
+      best = total;
+      bestBottom = b;
+      bestTop = t;
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    bool plane = i < bestBottom || i >= n - bestTop;
+    planes[i] = plane;
+    mStats[layers[i]->info().layerId].plane = plane;
+  }
+  ALOGV("%s: %zu layers, %zu planes below and %zu above the client target",
+        __func__, n, bestBottom, bestTop);
+}
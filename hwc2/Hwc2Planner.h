@@ -0,0 +1,64 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __HWC2_PLANNER_H__
+#define __HWC2_PLANNER_H__
+
+#include <map>
+#include <vector>
+
+#include "Hwc2Layer.h"
+
+// Picks the layers a mode 2 remote composes itself, each sent as its own
+// stream, within the number of planes the remote takes. SurfaceFlinger
+// composes the rest into the client target, which the remote draws at the
+// z of the lowest of them, so planes are taken from the bottom and the top
+// of the stack only. Big and often updated layers win, a layer keeps its
+// plane over close contenders so the assignment doesn't flip every frame.
+class Hwc2Planner {
+ public:
+  Hwc2Planner() {}
+  ~Hwc2Planner() {}
+
+  // layers in z order, planes[i] is set for the ones given a plane
+  void plan(const std::vector<Hwc2Layer*>& layers,
+            uint32_t maxPlanes,
+            uint32_t width,
+            uint32_t height,
+            std::vector<bool>& planes);
+  void reset() { mStats.clear(); }
+
+ private:
+  bool eligible(Hwc2Layer& layer) const;
+  uint64_t score(Hwc2Layer& layer, uint32_t width, uint32_t height);
+
+ private:
+  // update rate in 1/256, a moving average over about 8 frames
+  const uint32_t kRateOne = 256;
+  struct LayerStats {
+    uint32_t bufferSeq = 0;
+    uint32_t rate = 0;
+    bool plane = false;
+    bool seen = false;
+  };
+  std::map<uint64_t, LayerStats> mStats;
+};
+
+#endif  // __HWC2_PLANNER_H__
@@ -24,15 +24,49 @@ Date: 2021.06.09
 */
 
 #include "UioDisplay.h"
+#include "PixelKernels.h"
+#include "UioWatcher.h"
 #include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <sync/sync.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
 
 UioDisplay::UioDisplay(int id, int w, int h)
-    : mDisplayId(id), frame_id(0), mWidth(w), mHeight(h) {
+    : mDisplayId(id), mWidth(w), mHeight(h) {
   ALOGV("%s", __func__);
+  for (int i = 0; i < KVMFR_MAX_FRAMES; i++) {
+    mStaleFull[i] = true;
+    mSlotSeq[i] = 0;
+  }
 }
 
 UioDisplay::~UioDisplay() {
   ALOGV("%s", __func__);
+  UioWatcher::getWatcher().remove(this);
+  if (mCopyThread) {
+    {  // lock scope
+      std::lock_guard<std::mutex> lock(mCopyMutex);
+      mCopyStop = true;
+    }
+    mCopyEvent.notify_all();
+    uint64_t one = 1;
+    write(mCopyWakeFd, &one, sizeof(one));
+    mCopyThread->join();
+    mCopyThread = nullptr;
+  }
+  if (mCopyWakeFd >= 0) {
+    close(mCopyWakeFd);
+  }
+  releaseJob(mPendingJob.exchange(nullptr));
+  if (mShmAddr) {
+    munmap(mShmAddr, mShmSize);
+  }
+  if (mShmFd >= 0) {
+    close(mShmFd);
+  }
 }
 
 int UioDisplay::uioOpenFile(const char * shmDevice, const char * file) {
@@ -102,6 +136,7 @@ int UioDisplay::init() {
   if (access_address == MAP_FAILED)
   {
      ALOGE("Failed to mmap");
+     close(shmFd);
      return -1;
   }
   app.shmHeader        = (KVMFRHeader *)access_address;
@@ -109,8 +144,48 @@ int UioDisplay::init() {
   app.pointerDataSize  = 1024; // 1Kb for pointer, Android doesn't need this in fact
   app.pointerOffset    = app.pointerData - access_address;
   app.frames           = (uint8_t *)ALIGN_UP(app.pointerData + app.pointerDataSize);
-  app.frameSize        = ALIGN_DN((shmSize - (app.frames - access_address)) / MAX_FRAMES);
-  for (int i = 0; i < MAX_FRAMES; ++i)
+
+  char key[PROPERTY_KEY_MAX];
+  char value[PROPERTY_VALUE_MAX];
+  snprintf(key, sizeof(key), "hwc_vhal.uio%d.format", mDisplayId);
+  if (property_get(key, value, nullptr) > 0 && !strcmp(value, "yuv420")) {
+    mFrameType = FRAME_TYPE_YUV420;
+  }
+  snprintf(key, sizeof(key), "hwc_vhal.uio%d.frames", mDisplayId);
+  if (property_get(key, value, nullptr) > 0) {
+    mFrameCount = std::min(std::max(atoi(value), 2), KVMFR_MAX_FRAMES);
+  }
+  snprintf(key, sizeof(key), "hwc_vhal.uio%d.ring_policy", mDisplayId);
+  if (property_get(key, value, nullptr) > 0 && !strcmp(value, "nodrop")) {
+    mRingPolicy = RING_NO_DROP;
+  }
+  snprintf(key, sizeof(key), "hwc_vhal.uio%d.keep_mapped", mDisplayId);
+  if (property_get(key, value, nullptr) > 0 && !strcmp(value, "1")) {
+    mKeepMapped = true;
+  }
+  unsigned int framesSize = shmSize - (app.frames - access_address);
+  app.frameSize        = ALIGN_UP(frameBytes());
+  if (app.frameSize * kDefaultFrames > framesSize)
+  {
+    ALOGE("Frames of %u bytes don't fit in %u bytes of shm\n", app.frameSize,
+          framesSize);
+    munmap(access_address, shmSize);
+    close(shmFd);
+    return -1;
+  }
+  if (app.frameSize * mFrameCount > framesSize)
+  {
+    ALOGW("Only %u frames fit in shm, %u asked", framesSize / app.frameSize,
+          mFrameCount);
+    mFrameCount = framesSize / app.frameSize;
+  }
+  mShmFd = shmFd;
+  mShmAddr = access_address;
+  mShmSize = shmSize;
+  ALOGI("Uio display %d: %u %s frames of %u bytes, %s", mDisplayId,
+        mFrameCount, mFrameType == FRAME_TYPE_YUV420 ? "yuv420" : "rgba",
+        app.frameSize, mRingPolicy == RING_NO_DROP ? "nodrop" : "latest");
+  for (uint32_t i = 0; i < mFrameCount; ++i)
   {
     app.frame      [i] = app.frames + i * app.frameSize;
     app.frameOffset[i] = app.frame[i] - access_address;
@@ -120,51 +195,452 @@ int UioDisplay::init() {
   app.shmHeader->version = KVMFR_HEADER_VERSION;
   // zero and notify the client we are starting
   memset(&(app.shmHeader->frame ), 0, sizeof(KVMFRFrame ));
+  app.shmHeader->frameSeq = 0;
+  app.shmHeader->ackSeq = 0;
   app.shmHeader->flags &= ~KVMFR_HEADER_FLAG_RESTART;
   app.running = true;
-  mThread = std::unique_ptr<std::thread>(new std::thread(&UioDisplay::threadProc, this));
+
+  // without fences to tell when fb is copied, copy on the present thread
+  if (mTimeline.init() == 0) {
+    mCopyWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (mCopyWakeFd >= 0) {
+      mCopyThread = std::unique_ptr<std::thread>(
+          new std::thread(&UioDisplay::copyThreadProc, this));
+    }
+  }
+  // reading the uio device waits for its interrupt
+  UioWatcher::getWatcher().add(this, mShmFd);
   return 0;
 }
 
-int UioDisplay::postFb(buffer_handle_t fb) {
-  ALOGV("%s", __func__);
-  if (app.running && (0 == mDisplayId)) {
-    app.shmHeader->flags &= ~KVMFR_HEADER_FLAG_READY;
-    volatile KVMFRFrame * fi = &(app.shmHeader->frame);
-    uint8_t* rgb = nullptr;
-    uint32_t stride = 0;
-    auto& mapper = BufferMapper::getMapper();
-    buffer_handle_t bufferHandle;
-    mapper.importBuffer(fb, &bufferHandle);
-    mapper.lockBuffer(bufferHandle, rgb, stride);
-    if (rgb) {
-      for (uint32_t i = 0; i < mHeight; i++) {
-        memcpy(app.frame[frame_id] + i * mWidth * 4, rgb + i * stride * 4, mWidth * 4);
+void UioDisplay::addDamage(const std::vector<rect_t>* damage) {
+  bool full = !damage || damage->empty();
+
+  for (uint32_t i = 0; i < mFrameCount; i++) {
+    if (mStaleFull[i])
+      continue;
+    if (full) {
+      mStaleFull[i] = true;
+      mStaleRects[i].clear();
+      continue;
+    }
+    auto& stale = mStaleRects[i];
+    for (auto& r : *damage) {
+      if (r.right > r.left && r.bottom > r.top)
+        stale.push_back(r);
+    }
+    if (stale.size() > kMaxStaleRects) {
+      // keep the bounding box of what piled up
+      rect_t box = stale[0];
+      for (auto& r : stale) {
+        box.left = std::min(box.left, r.left);
+        box.top = std::min(box.top, r.top);
+        box.right = std::max(box.right, r.right);
+        box.bottom = std::max(box.bottom, r.bottom);
+      }
+      stale.clear();
+      stale.push_back(box);
+    }
+  }
+}
+
+uint32_t UioDisplay::frameBytes() const {
+  if (mFrameType == FRAME_TYPE_YUV420) {
+    // full size Y plane then U and V planes of half width and height
+    return mWidth * mHeight + 2 * ((mWidth + 1) / 2) * ((mHeight + 1) / 2);
+  }
+  return mWidth * mHeight * 4;
+}
+
+void UioDisplay::copyRect(uint8_t* dst,
+                          const MappedBuffer& buffer,
+                          const uint8_t* src,
+                          const rect_t& r) {
+  // the client target may be smaller than the display, e.g. mid resize
+  uint32_t stride = buffer.stride * 4;
+  int maxWidth = std::min(mWidth, buffer.width);
+  int maxHeight = std::min(mHeight, buffer.height);
+  int left = std::max(r.left, 0);
+  int top = std::max(r.top, 0);
+  int right = std::min(r.right, maxWidth);
+  int bottom = std::min(r.bottom, maxHeight);
+  if (right <= left || bottom <= top)
+    return;
+  bool bgra = buffer.format == HAL_PIXEL_FORMAT_BGRA_8888;
+
+  if (mFrameType == FRAME_TYPE_YUV420) {
+    // Whole chroma blocks, within the buffer. An odd last column or row of
+    // the buffer is averaged with itself by the kernel.
+    left &= ~1;
+    top &= ~1;
+    right = std::min((right + 1) & ~1, maxWidth);
+    bottom = std::min((bottom + 1) & ~1, maxHeight);
+    uint32_t width = right - left;
+    uint32_t height = bottom - top;
+    const uint8_t* s = src + top * stride + left * 4;
+    if (bgra) {
+      mSwizzled.resize(width * height * 4);
+      PixelKernels::swizzle(mSwizzled.data(), width * 4, s, stride, width,
+                            height);
+      s = mSwizzled.data();
+      stride = width * 4;
+    }
+    uint32_t chromaW = (mWidth + 1) / 2;
+    uint8_t* u = dst + mWidth * mHeight;
+    uint8_t* v = u + chromaW * ((mHeight + 1) / 2);
+    uint32_t chromaOffset = top / 2 * chromaW + left / 2;
+    PixelKernels::rgbaToI420(s, stride, width, height,
+                             dst + top * mWidth + left, mWidth,
+                             u + chromaOffset, chromaW, v + chromaOffset,
+                             chromaW);
+    return;
+  }
+  // the frame in shm is RGBA
+  if (bgra) {
+    PixelKernels::swizzle(dst + (top * mWidth + left) * 4, mWidth * 4,
+                          src + top * stride + left * 4, stride, right - left,
+                          bottom - top);
+    return;
+  }
+  PixelKernels::copy(dst + (top * mWidth + left) * 4, mWidth * 4,
+                     src + top * stride + left * 4, stride, right - left,
+                     bottom - top);
+}
+
+void UioDisplay::publishDamage(volatile KVMFRFrame* fi,
+                               const std::vector<rect_t>* damage) {
+  if (!damage || damage->empty() || damage->size() > KVMFR_MAX_DAMAGE_RECTS) {
+    fi->damageRectsCount = 0;
+    return;
+  }
+
+  uint32_t n = 0;
+  for (auto& r : *damage) {
+    int left = std::max(r.left, 0);
+    int top = std::max(r.top, 0);
+    int right = std::min(r.right, (int)mWidth);
+    int bottom = std::min(r.bottom, (int)mHeight);
+    if (right <= left || bottom <= top)
+      continue;
+    fi->damageRects[n].x = left;
+    fi->damageRects[n].y = top;
+    fi->damageRects[n].width = right - left;
+    fi->damageRects[n].height = bottom - top;
+    n++;
+  }
+  if (n == 0) {
+    // nothing changed, still a valid rect so it doesn't read as full
+    fi->damageRects[0].x = 0;
+    fi->damageRects[0].y = 0;
+    fi->damageRects[0].width = 0;
+    fi->damageRects[0].height = 0;
+    n = 1;
+  }
+  fi->damageRectsCount = n;
+}
+
+void UioDisplay::releaseJob(CopyJob* job) {
+  if (!job)
+    return;
+
+  if (job->acquireFence >= 0) {
+    close(job->acquireFence);
+  }
+  delete job;
+}
+
+UioDisplay::MappedBuffer::~MappedBuffer() {
+  auto& mapper = BufferMapper::getMapper();
+  if (data) {
+    mapper.unlockBuffer(handle);
+  }
+  mapper.release(handle);
+}
+
+std::shared_ptr<UioDisplay::MappedBuffer> UioDisplay::getBuffer(
+    buffer_handle_t fb) {
+  RemoteDisplay::BufferKey key;
+  if (RemoteDisplay::getBufferKey(fb, key) < 0)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(mBufferMutex);
+  for (size_t i = 0; i < mMappedBuffers.size(); i++) {
+    if (mMappedBuffers[i]->key == key) {
+      auto buffer = mMappedBuffers[i];
+      mMappedBuffers.erase(mMappedBuffers.begin() + i);
+      mMappedBuffers.insert(mMappedBuffers.begin(), buffer);
+      return buffer;
+    }
+  }
+
+  auto& mapper = BufferMapper::getMapper();
+  std::shared_ptr<MappedBuffer> buffer(new MappedBuffer());
+  buffer->key = key;
+  if (mapper.importBuffer(fb, &buffer->handle) < 0) {
+    ALOGE("Failed to import client target %p", fb);
+    buffer->handle = nullptr;
+    return nullptr;
+  }
+  BufferMapper::BufferInfo info;
+  if (mapper.describe(buffer->handle, info) < 0) {
+    return nullptr;
+  }
+  buffer->width = info.width;
+  buffer->height = info.height;
+  buffer->stride = info.stride;
+  buffer->format = info.format;
+  if (mKeepMapped) {
+    uint8_t* data = nullptr;
+    if (mapper.lockBuffer(buffer->handle, buffer->width, buffer->height,
+                          data) == 0) {
+      buffer->data = data;
+    }
+  }
+
+  if (mMappedBuffers.size() >= kMaxMappedBuffers) {
+    mMappedBuffers.pop_back();
+  }
+  mMappedBuffers.insert(mMappedBuffers.begin(), buffer);
+  return buffer;
+}
+
+void UioDisplay::releaseBuffers() {
+  std::lock_guard<std::mutex> lock(mBufferMutex);
+  mMappedBuffers.clear();
+}
+
+bool UioDisplay::slotFree(int slot) {
+  volatile KVMFRHeader* header = app.shmHeader;
+  if (!(header->flags & KVMFR_HEADER_FLAG_ACK))
+    return true;
+
+  uint32_t ack = header->ackSeq;
+  if (mClientStalled && ack == mStalledAck)
+    return true;
+  mClientStalled = false;
+  // the slot writes must not start before the ack is seen
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return (int32_t)(mSlotSeq[slot] - ack) <= 0;
+}
+
+int UioDisplay::acquireSlot(CopyJob*& job) {
+  int slot = mFrameSeq % mFrameCount;
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(kSlotTimeoutMs);
+  std::unique_lock<std::mutex> lk(mCopyMutex);
+  while (!slotFree(slot)) {
+    if (mCopyStop || std::chrono::steady_clock::now() >= deadline) {
+      ALOGW("Client didn't ack frame %u in time, overwrite it",
+            mSlotSeq[slot]);
+      mClientStalled = true;
+      mStalledAck = app.shmHeader->ackSeq;
+      break;
+    }
+    if (mRingPolicy == RING_LATEST) {
+      CopyJob* newer = mPendingJob.exchange(nullptr);
+      if (newer) {
+        mergeJob(newer, job);
+        job = newer;
       }
-      fi->type = FRAME_TYPE_RGBA;
-      fi->width   = mWidth;
-      fi->height  = mHeight;
-      fi->stride  = stride;
-      fi->pitch   = fi->width * 4;
-      fi->dataPos = app.frameOffset[frame_id];
-      fi->flags = KVMFR_FRAME_FLAG_UPDATE;
-      fi->rotate = mRot;
+    }
+    // the watcher also looks at the client every kPollMs, the deadline only
+    // covers a client gone
+    mCopyEvent.wait_until(lk, deadline);
+  }
+  return slot;
+}
+
+void UioDisplay::copyFrame(CopyJob* job, int slot) {
+  ALOGV("%s", __func__);
+
+  app.shmHeader->flags &= ~KVMFR_HEADER_FLAG_READY;
+  volatile KVMFRFrame * fi = &(app.shmHeader->frame);
+  uint8_t* rgb = nullptr;
+  auto& mapper = BufferMapper::getMapper();
+
+  if (job->acquireFence >= 0 && sync_wait(job->acquireFence, 1000) < 0) {
+    ALOGW("Wait for fb acquire fence failed, copy anyway");
+  }
+  MappedBuffer* buffer = job->buffer.get();
+  rgb = buffer->data;
+  bool locked = false;
+  if (!rgb) {
+    locked = mapper.lockBuffer(buffer->handle, buffer->width, buffer->height,
+                               rgb) == 0;
+  }
+  // a buffer not covering the slot leaves part of it behind, damage doesn't
+  // describe what the slots hold then
+  bool sizeMismatch = buffer->width != mWidth || buffer->height != mHeight;
+  addDamage(sizeMismatch ? nullptr : &job->damage);
+  if (rgb) {
+    // bring the slot up to date with all frames posted since it was used
+    uint8_t* dst = app.frame[slot];
+    if (mStaleFull[slot]) {
+      rect_t all = {0, 0, (int)mWidth, (int)mHeight};
+      copyRect(dst, *buffer, rgb, all);
     } else {
-      ALOGE("Failed to lock front buffer\n");
+      for (auto& r : mStaleRects[slot]) {
+        copyRect(dst, *buffer, rgb, r);
+      }
     }
+    mStaleFull[slot] = sizeMismatch;
+    mStaleRects[slot].clear();
 
-    mapper.unlockBuffer(bufferHandle);
-    mapper.release(bufferHandle);
-    if(++frame_id >= 2)
-      frame_id = 0;
+    std::lock_guard<std::mutex> lock(mPublishMutex);
+    fi->type = mFrameType;
+    fi->width   = mWidth;
+    fi->height  = mHeight;
+    // of the frame in shm, for YUV420 the ones of the Y plane
+    fi->stride  = mWidth;
+    fi->pitch   = mFrameType == FRAME_TYPE_YUV420 ? mWidth : mWidth * 4;
+    fi->dataPos = app.frameOffset[slot];
+    publishDamage(fi, mClientReset || sizeMismatch ? nullptr : &job->damage);
+    mClientReset = false;
+    fi->rotate = job->rotation;
+    mSlotSeq[slot] = ++mFrameSeq;
+    std::atomic_thread_fence(std::memory_order_release);
+    app.shmHeader->frameSeq = mFrameSeq;
+    fi->flags = KVMFR_FRAME_FLAG_UPDATE;
+  } else {
+    ALOGE("Failed to lock front buffer\n");
+    mStaleFull[slot] = true;
   }
+
+  if (locked) {
+    mapper.unlockBuffer(buffer->handle);
+  }
+}
+
+void UioDisplay::mergeJob(CopyJob* job, CopyJob* older) {
+  // the older frame is dropped, job carries its damage
+  if (older->damage.empty() || job->damage.empty()) {
+    job->damage.clear();
+  } else {
+    job->damage.insert(job->damage.end(), older->damage.begin(),
+                       older->damage.end());
+  }
+  releaseJob(older);
+  mDroppedFrames++;
+  ALOGV("%s: dropped frame, %d so far", __func__, mDroppedFrames.load());
+}
+
+int UioDisplay::postFb(buffer_handle_t fb,
+                       const std::vector<rect_t>* damage,
+                       int acquireFence,
+                       int* releaseFence) {
+  ALOGV("%s", __func__);
+
+  *releaseFence = -1;
+  if (!app.running || (0 != mDisplayId)) {
+    if (acquireFence >= 0) {
+      close(acquireFence);
+    }
+    return 0;
+  }
+
+  auto buffer = getBuffer(fb);
+  if (!buffer) {
+    if (acquireFence >= 0) {
+      close(acquireFence);
+    }
+    return -1;
+  }
+
+  CopyJob* job = new CopyJob();
+  job->buffer = buffer;
+  job->acquireFence = acquireFence;
+  if (damage) {
+    job->damage = *damage;
+  }
+  job->rotation = mRot;
+
+  if (!mCopyThread) {
+    int slot = acquireSlot(job);
+    copyFrame(job, slot);
+    releaseJob(job);
+    return 0;
+  }
+
+  job->fenceValue = ++mFenceValue;
+  *releaseFence = mTimeline.createFence(job->fenceValue);
+
+  {  // lock scope
+    std::unique_lock<std::mutex> lk(mCopyMutex);
+    if (mRingPolicy == RING_NO_DROP) {
+      // hold the present until the worker took the previous frame
+      mJobTaken.wait_for(lk, std::chrono::milliseconds(kSlotTimeoutMs),
+                         [this] { return !mPendingJob.load(); });
+    }
+    // the worker lags, drop the frame it didn't start yet and carry its
+    // damage
+    CopyJob* old = mPendingJob.exchange(nullptr);
+    if (old) {
+      mergeJob(job, old);
+    }
+    mPendingJob.store(job);
+  }
+  // a worker waiting for a slot takes this one instead
+  mCopyEvent.notify_all();
+
+  uint64_t one = 1;
+  write(mCopyWakeFd, &one, sizeof(one));
   return 0;
 }
 
-void UioDisplay::threadProc() {
-  while (true) {
-    if (app.shmHeader->flags & KVMFR_HEADER_FLAG_RESTART)
-      app.shmHeader->flags &= ~KVMFR_HEADER_FLAG_RESTART;
-    usleep(16000);
+void UioDisplay::copyThreadProc() {
+  while (!mCopyStop) {
+    uint64_t count;
+    if (read(mCopyWakeFd, &count, sizeof(count)) < 0 && errno != EINTR) {
+      ALOGE("Copy worker wait failed:%s", strerror(errno));
+      break;
+    }
+    CopyJob* job;
+    {  // lock scope
+      std::lock_guard<std::mutex> lock(mCopyMutex);
+      job = mPendingJob.exchange(nullptr);
+    }
+    mJobTaken.notify_all();
+    if (!job)
+      continue;
+
+    int slot = acquireSlot(job);
+    copyFrame(job, slot);
+    // also signals the fences of the frames dropped before it
+    mTimeline.signal(job->fenceValue);
+    releaseJob(job);
+  }
+}
+
+void UioDisplay::handleClientEvents() {
+  handleClientReset();
+
+  // the client may have acked the slot the worker waits for
+  {  // lock scope
+    std::lock_guard<std::mutex> lock(mCopyMutex);
   }
+  mCopyEvent.notify_all();
+}
+
+void UioDisplay::handleClientReset() {
+  volatile KVMFRHeader* header = app.shmHeader;
+  std::lock_guard<std::mutex> lock(mPublishMutex);
+  if (header->flags & KVMFR_HEADER_FLAG_RESTART) {
+    ALOGI("Uio display %d: client restarted", mDisplayId);
+    header->flags &= ~KVMFR_HEADER_FLAG_RESTART;
+    // the new client holds none of the older frames
+    if (mFrameSeq > 0) {
+      header->ackSeq = mFrameSeq - 1;
+    }
+    mClientReset = true;
+  }
+  if (!mClientReset || !(header->flags & KVMFR_HEADER_FLAG_READY))
+    return;
+
+  mClientReset = false;
+  if (mFrameSeq == 0)
+    return;
+  ALOGV("%s: republish frame %u", __func__, mFrameSeq);
+  publishDamage(&header->frame, nullptr);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->frame.flags = KVMFR_FRAME_FLAG_UPDATE;
 }
@@ -34,20 +34,31 @@ Date: 2021.06.09
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 #include "BufferMapper.h"
+#include "RemoteDisplay.h"
+#include "SyncTimeline.h"
+#include "display_protocol.h"
 
 #define ALIGN_DN(x) ((uintptr_t)(x) & ~0x7F)
 #define ALIGN_UP(x) ALIGN_DN(x + 0x7F)
 #define KVMFR_HEADER_MAGIC   "[[KVMFR]]"
 #define KVMFR_HEADER_VERSION 8
-#define MAX_FRAMES 2
+#define KVMFR_MAX_FRAMES 8
 
 #define KVMFR_FRAME_FLAG_UPDATE 1 // frame update available
+#define KVMFR_MAX_DAMAGE_RECTS 4
 
 #define KVMFR_HEADER_FLAG_RESTART 1 // restart signal from client
 #define KVMFR_HEADER_FLAG_READY   2 // ready signal from client
 #define KVMFR_HEADER_FLAG_PAUSED  4 // capture has been paused by the host
+#define KVMFR_HEADER_FLAG_ACK     8 // client acks the frames it read in ackSeq
 
 class UioDisplay {
 
@@ -61,6 +72,15 @@ class UioDisplay {
     FRAME_TYPE_YUV420    , // YUV420
     FRAME_TYPE_MAX       , // sentinel value
   };
+  struct FrameDamageRect
+  {
+    uint32_t    x;
+    uint32_t    y;
+    uint32_t    width;
+    uint32_t    height;
+  };
+  // damage is appended so clients not reading it keep working, it is relative
+  // to the previously posted frame and no rect means the whole frame
   struct KVMFRFrame
   {
     uint8_t     flags;       // KVMFR_FRAME_FLAGS
@@ -71,6 +91,8 @@ class UioDisplay {
     uint32_t    pitch;       // the row pitch  (stride in bytes or the compressed frame size)
     uint64_t    dataPos;     // offset to the frame
     uint8_t     rotate;      // the frame rotation
+    uint32_t    damageRectsCount;
+    FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
   };
   struct KVMFRHeader
   {
@@ -78,6 +100,9 @@ class UioDisplay {
     uint32_t    version;     // version of this structure
     uint8_t     flags;       // KVMFR_HEADER_FLAGS
     KVMFRFrame  frame;       // the frame information
+    // appended, a slot is only reused once the client acked the frame in it
+    uint32_t    frameSeq;    // sequence number of frame, from 1
+    uint32_t    ackSeq;      // last frame the client is done with
   };
   struct app
   {
@@ -87,33 +112,134 @@ class UioDisplay {
     unsigned int  pointerOffset;
     uint8_t     * frames;
     unsigned int  frameSize;
-    uint8_t     * frame[MAX_FRAMES];
-    unsigned int  frameOffset[MAX_FRAMES];
+    uint8_t     * frame[KVMFR_MAX_FRAMES];
+    unsigned int  frameOffset[KVMFR_MAX_FRAMES];
     bool          running;
   };
 
  public:
   UioDisplay(int id, int w, int h);
   ~UioDisplay();
-  int postFb(buffer_handle_t fb);
+  // Queue fb to be copied by the copy worker. damage is null or empty if
+  // the whole buffer changed. Takes ownership of acquireFence, releaseFence
+  // is signaled once fb has been copied or dropped, -1 if fb is done with.
+  int postFb(buffer_handle_t fb,
+             const std::vector<rect_t>* damage,
+             int acquireFence,
+             int* releaseFence);
   int init();
   void setRotation(int rot) {
     mRot = rot;
   }
+  // called by UioWatcher when the client may have changed the header flags
+  void handleClientEvents();
+  // drops the cached client target buffers, the ones still queued for copy
+  // are released once copied
+  void releaseBuffers();
 
  private:
   int mDisplayId = 0;
   struct app app;
-  int frame_id = 0;
   uint32_t mWidth = 720;
   uint32_t mHeight = 1280;
   int mRot = 0;
-  std::unique_ptr<std::thread> mThread;
+  // RGBA, or planar YUV420 (I420) when hwc_vhal.uio<id>.format is yuv420
+  FrameType mFrameType = FRAME_TYPE_RGBA;
+  int mShmFd = -1;
+  uint8_t* mShmAddr = nullptr;
+  unsigned int mShmSize = 0;
+
+  // held while the frame header is written. A restarted client gets the last
+  // frame again, whole, once it is ready.
+  std::mutex mPublishMutex;
+  bool mClientReset = false;
+
+  // Frames go round a ring of hwc_vhal.uio<id>.frames slots. When the client
+  // acks frames, a slot it still reads is waited for, by the copy worker
+  // taking newer frames meanwhile (latest), or by holding the present too
+  // when hwc_vhal.uio<id>.ring_policy is nodrop. The waits end on the
+  // client's interrupt or when the worker takes a frame, a client not acking
+  // for kSlotTimeoutMs is taken as gone.
+  enum RingPolicy {
+    RING_LATEST,
+    RING_NO_DROP,
+  };
+  const uint32_t kDefaultFrames = 2;
+  const int kSlotTimeoutMs = 100;
+  uint32_t mFrameCount = kDefaultFrames;
+  RingPolicy mRingPolicy = RING_LATEST;
+  uint32_t mFrameSeq = 0;
+  uint32_t mSlotSeq[KVMFR_MAX_FRAMES];
+  bool mClientStalled = false;
+  uint32_t mStalledAck = 0;
+
+  // Client target buffers imported once and reused while SurfaceFlinger
+  // cycles through them, keyed like the remote buffers. With
+  // hwc_vhal.uio<id>.keep_mapped they also stay locked for cpu reads, for
+  // gralloc implementations where the mapping stays coherent.
+  struct MappedBuffer {
+    ~MappedBuffer();
+    RemoteDisplay::BufferKey key;
+    buffer_handle_t handle = nullptr;  // imported
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t stride = 0;  // in pixels
+    int32_t format = 0;
+    uint8_t* data = nullptr;  // only when kept mapped
+  };
+  const size_t kMaxMappedBuffers = 4;
+  bool mKeepMapped = false;
+  std::mutex mBufferMutex;
+  // most recently used first
+  std::vector<std::shared_ptr<MappedBuffer>> mMappedBuffers;
+
+  // Frames waiting for the copy worker. The single pending job is replaced
+  // by a newer one when the worker lags, merging the damage.
+  struct CopyJob {
+    std::shared_ptr<MappedBuffer> buffer;
+    int acquireFence;
+    std::vector<rect_t> damage;  // empty is the whole buffer
+    int rotation;
+    uint32_t fenceValue;
+  };
+  std::atomic<CopyJob*> mPendingJob{nullptr};
+  // taken to post, take or wait for frames and slots
+  std::mutex mCopyMutex;
+  // a frame was posted, the client rang or the worker stops
+  std::condition_variable mCopyEvent;
+  // the worker took the pending frame
+  std::condition_variable mJobTaken;
+  std::unique_ptr<std::thread> mCopyThread;
+  std::atomic<bool> mCopyStop{false};
+  int mCopyWakeFd = -1;
+  SyncTimeline mTimeline;
+  uint32_t mFenceValue = 0;
+  std::atomic<int> mDroppedFrames{0};
+  // what changed since each frame slot was last written, the slots are
+  // only brought up to date when reused
+  static const size_t kMaxStaleRects = 16;
+  std::vector<rect_t> mStaleRects[KVMFR_MAX_FRAMES];
+  bool mStaleFull[KVMFR_MAX_FRAMES];
+  // BGRA client target area converted to RGBA before the YUV conversion
+  std::vector<uint8_t> mSwizzled;
 
  private:
   int uioOpenFile(const char * shmDevice, const char * file);
   int shmOpenDev(const char * shmDevice);
-  void threadProc();
+  void copyThreadProc();
+  void handleClientReset();
+  int acquireSlot(CopyJob*& job);
+  bool slotFree(int slot);
+  void copyFrame(CopyJob* job, int slot);
+  void mergeJob(CopyJob* job, CopyJob* older);
+  void releaseJob(CopyJob* job);
+  std::shared_ptr<MappedBuffer> getBuffer(buffer_handle_t fb);
+  void addDamage(const std::vector<rect_t>* damage);
+  void copyRect(uint8_t* dst, const MappedBuffer& src, const uint8_t* data,
+                const rect_t& r);
+  uint32_t frameBytes() const;
+  void publishDamage(volatile KVMFRFrame* fi,
+                     const std::vector<rect_t>* damage);
 
 };
 
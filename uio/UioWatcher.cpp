@@ -0,0 +1,180 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "UioDisplay.h"
+#include "UioWatcher.h"
+
+UioWatcher::~UioWatcher() {
+  stop();
+}
+
+int UioWatcher::add(UioDisplay* display, int irqFd) {
+  ALOGV("UioWatcher::%s", __func__);
+
+  std::lock_guard<std::mutex> control(mControlMutex);
+  if (!mThread && start() < 0) {
+    return -1;
+  }
+
+  if (irqFd >= 0) {
+    // uio drivers with irqcontrol mask the interrupt until it is written,
+    // the others reject the write
+    int32_t enable = 1;
+    write(irqFd, &enable, sizeof(enable));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = display;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, irqFd, &ev) < 0) {
+      ALOGW("Can't wait on uio interrupts, poll only:%s", strerror(errno));
+      irqFd = -1;
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  mDisplays.push_back({display, irqFd});
+  lock.unlock();
+  // look at the flags the client set before
+  wake();
+  return 0;
+}
+
+void UioWatcher::remove(UioDisplay* display) {
+  ALOGV("UioWatcher::%s", __func__);
+
+  std::lock_guard<std::mutex> control(mControlMutex);
+  std::unique_lock<std::mutex> lock(mMutex);
+  auto it = std::find_if(mDisplays.begin(), mDisplays.end(),
+                         [display](const Entry& e) {
+                           return e.display == display;
+                         });
+  if (it == mDisplays.end())
+    return;
+
+  if (it->irqFd >= 0) {
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, it->irqFd, nullptr);
+  }
+  mDisplays.erase(it);
+  bool empty = mDisplays.empty();
+  lock.unlock();
+
+  if (empty) {
+    stop();
+  }
+}
+
+int UioWatcher::start() {
+  mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  mWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (mEpollFd < 0 || mWakeFd < 0) {
+    ALOGE("Failed to create uio watcher fds:%s", strerror(errno));
+    stop();
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev) < 0) {
+    ALOGE("Failed to watch wake fd:%s", strerror(errno));
+    stop();
+    return -1;
+  }
+
+  mStop = false;
+  mThread = std::unique_ptr<std::thread>(
+      new std::thread(&UioWatcher::threadProc, this));
+  return 0;
+}
+
+void UioWatcher::stop() {
+  if (mThread) {
+    mStop = true;
+    wake();
+    mThread->join();
+    mThread = nullptr;
+  }
+  if (mWakeFd >= 0) {
+    close(mWakeFd);
+    mWakeFd = -1;
+  }
+  if (mEpollFd >= 0) {
+    close(mEpollFd);
+    mEpollFd = -1;
+  }
+}
+
+void UioWatcher::wake() {
+  uint64_t one = 1;
+  write(mWakeFd, &one, sizeof(one));
+}
+
+void UioWatcher::threadProc() {
+  const int kMaxEvents = 8;
+  struct epoll_event events[kMaxEvents];
+
+  while (!mStop) {
+    int n = epoll_wait(mEpollFd, events, kMaxEvents, kPollMs);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ALOGE("Uio watcher wait failed:%s", strerror(errno));
+      break;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (int i = 0; i < n; i++) {
+      if (!events[i].data.ptr) {
+        uint64_t count;
+        read(mWakeFd, &count, sizeof(count));
+        continue;
+      }
+      for (auto& e : mDisplays) {
+        if (e.display != events[i].data.ptr || e.irqFd < 0)
+          continue;
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          // no interrupt on this device, the poll covers it
+          epoll_ctl(mEpollFd, EPOLL_CTL_DEL, e.irqFd, nullptr);
+          e.irqFd = -1;
+          continue;
+        }
+        int32_t count;
+        read(e.irqFd, &count, sizeof(count));
+        int32_t enable = 1;
+        write(e.irqFd, &enable, sizeof(enable));
+      }
+    }
+    // the flags are cheap to read, look at all displays
+    for (auto& e : mDisplays) {
+      e.display->handleClientEvents();
+    }
+  }
+}
@@ -0,0 +1,78 @@
+/*
+Copyright (C) 2021 Intel Corporation
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions
+and limitations under the License.
+
+
+SPDX-License-Identifier: Apache-2.0
+
+*/
+
+#ifndef __UIO_WATCHER_H__
+#define __UIO_WATCHER_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class UioDisplay;
+
+// One thread for the KVMFR client flags of all uio displays. It sleeps on
+// the uio interrupt fds and checks every display when one fires. Clients
+// that set the flags without ringing the interrupt are picked up by a slow
+// poll. The thread runs while displays are registered.
+class UioWatcher {
+ public:
+  static UioWatcher& getWatcher() {
+    static UioWatcher sInst;
+    return sInst;
+  }
+  ~UioWatcher();
+
+  // irqFd is the /dev/uioN fd of the display, -1 to only poll it
+  int add(UioDisplay* display, int irqFd);
+  // once it returns the display isn't called anymore
+  void remove(UioDisplay* display);
+
+ private:
+  UioWatcher() {}
+  UioWatcher(const UioWatcher&) = delete;
+  UioWatcher& operator=(const UioWatcher&) = delete;
+
+  int start();
+  void stop();
+  void wake();
+  void threadProc();
+
+ private:
+  const int kPollMs = 100;
+
+  struct Entry {
+    UioDisplay* display;
+    int irqFd;
+  };
+  // add and remove, held while the thread starts or stops
+  std::mutex mControlMutex;
+  // the displays, held while the thread calls them
+  std::mutex mMutex;
+  std::vector<Entry> mDisplays;
+
+  std::unique_ptr<std::thread> mThread;
+  std::atomic<bool> mStop{false};
+  int mEpollFd = -1;
+  int mWakeFd = -1;
+};
+
+#endif  // __UIO_WATCHER_H__